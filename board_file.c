@@ -105,28 +105,35 @@ struct gpio_peripheral indigo_all_peripherals [7][3] = {
 					.schematics_name = "STAT1",
 					.description = "Статус режиме работы:precharge in progress(S1-ON, S2-ON), fast charge in progress(S1-ON, S2-OFF), Charge done(S1-OFF, S2-ON),Charge suspend(S1-OFF, S2-OFF).",
 					.pin_no = AT91_PIN_PA24,
-					.flags = GPIOF_DIR_IN | GPIOF_PULLUP
+					.flags = GPIOF_DIR_IN | GPIOF_PULLUP | GPIOF_DEGLITCH | GPIOF_POLLABLE | GPIOF_EDGE_BOTH,
+					.debounce_ms = 20,
+					.max_rate_hz = 2
 				},
 				{
 					.function = INDIGO_FUNCTION_NO_FUNCTION,
 					.schematics_name = "STAT2",
 					.description = "Статус режиме работы:precharge in progress(S1-ON, S2-ON), fast charge in progress(S1-ON, S2-OFF), Charge done(S1-OFF, S2-ON),Charge suspend(S1-OFF, S2-OFF).",
 					.pin_no = AT91_PIN_PA25,
-					.flags = GPIOF_DIR_IN | GPIOF_PULLUP
+					.flags = GPIOF_DIR_IN | GPIOF_PULLUP | GPIOF_DEGLITCH | GPIOF_POLLABLE | GPIOF_EDGE_BOTH,
+					.debounce_ms = 20,
+					.max_rate_hz = 2
 				},
 				{
 					.function = INDIGO_FUNCTION_NO_FUNCTION,
 					.schematics_name = "Acpg",
 					.description = "состояние внешнего источника питания. 0 - хорошо, 1 - плохо",
 					.pin_no = AT91_PIN_PA26,
-					.flags = GPIOF_DIR_IN | GPIOF_PULLUP
+					.flags = GPIOF_DIR_IN | GPIOF_PULLUP | GPIOF_DEGLITCH | GPIOF_POLLABLE | GPIOF_EDGE_BOTH,
+					.debounce_ms = 50
 				},
 				{
 					.function = INDIGO_FUNCTION_NO_FUNCTION,
 					.schematics_name = "on_off_sensor",
 					.description = "хз что это",
 					.pin_no = AT91_PIN_PA27,
-					.flags = GPIOF_DIR_IN | GPIOF_PULLUP
+					.flags = GPIOF_DIR_IN | GPIOF_PULLUP | GPIOF_DEGLITCH | GPIOF_POLLABLE | GPIOF_EDGE_BOTH,
+					.debounce_ms = 30,
+					.max_rate_hz = 5
 				},
 			}
 
@@ -0,0 +1,184 @@
+/*
+ * Tracepoints of indigo-gpioperiph, installed as
+ * include/trace/events/indigo_gpioperiph.h
+ *
+ * echo 1 > /sys/kernel/debug/tracing/events/indigo_gpioperiph/enable
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM indigo_gpioperiph
+
+#if !defined(_TRACE_INDIGO_GPIOPERIPH_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_INDIGO_GPIOPERIPH_H
+
+#include <linux/tracepoint.h>
+#include <linux/indigo-gpioperiph.h>
+
+#define show_indigo_command(cmd)					\
+	__print_symbolic(cmd,						\
+		{ INDIGO_COMMAND_NO_COMMAND, "no_command" },		\
+		{ INDIGO_COMMAND_POWER_ON, "power_on" },		\
+		{ INDIGO_COMMAND_POWER_OFF, "power_off" },		\
+		{ INDIGO_COMMAND_RESET, "reset" },			\
+		{ INDIGO_COMMAND_CHECK_AND_POWER_ON, "check_and_power_on" }, \
+		{ INDIGO_COMMAND_STATE_TRANSITION, "state_transition" })
+
+TRACE_EVENT(indigo_command_enqueue,
+
+	TP_PROTO(const char *periph, u32 id, int cmd, bool joined),
+
+	TP_ARGS(periph, id, cmd, joined),
+
+	TP_STRUCT__entry(
+		__string(periph, periph)
+		__field(u32, id)
+		__field(int, cmd)
+		__field(bool, joined)
+	),
+
+	TP_fast_assign(
+		__assign_str(periph, periph);
+		__entry->id = id;
+		__entry->cmd = cmd;
+		__entry->joined = joined;
+	),
+
+	TP_printk("%s id=%u %s%s", __get_str(periph), __entry->id,
+		show_indigo_command(__entry->cmd),
+		__entry->joined ? " joined" : "")
+);
+
+TRACE_EVENT(indigo_command_start,
+
+	TP_PROTO(const char *periph, u32 id, int cmd),
+
+	TP_ARGS(periph, id, cmd),
+
+	TP_STRUCT__entry(
+		__string(periph, periph)
+		__field(u32, id)
+		__field(int, cmd)
+	),
+
+	TP_fast_assign(
+		__assign_str(periph, periph);
+		__entry->id = id;
+		__entry->cmd = cmd;
+	),
+
+	TP_printk("%s id=%u %s", __get_str(periph), __entry->id,
+		show_indigo_command(__entry->cmd))
+);
+
+TRACE_EVENT(indigo_command_finish,
+
+	TP_PROTO(const char *periph, u32 id, int cmd, int result),
+
+	TP_ARGS(periph, id, cmd, result),
+
+	TP_STRUCT__entry(
+		__string(periph, periph)
+		__field(u32, id)
+		__field(int, cmd)
+		__field(int, result)
+	),
+
+	TP_fast_assign(
+		__assign_str(periph, periph);
+		__entry->id = id;
+		__entry->cmd = cmd;
+		__entry->result = result;
+	),
+
+	TP_printk("%s id=%u %s result=%d", __get_str(periph), __entry->id,
+		show_indigo_command(__entry->cmd), __entry->result)
+);
+
+/* @actual_us is from the pin write to the end of the step's sleep */
+TRACE_EVENT(indigo_sequence_step,
+
+	TP_PROTO(const char *periph, const char *step_no, int function,
+		int value, int requested_ms, s64 actual_us),
+
+	TP_ARGS(periph, step_no, function, value, requested_ms, actual_us),
+
+	TP_STRUCT__entry(
+		__string(periph, periph)
+		__string(step_no, step_no)
+		__field(int, function)
+		__field(int, value)
+		__field(int, requested_ms)
+		__field(s64, actual_us)
+	),
+
+	TP_fast_assign(
+		__assign_str(periph, periph);
+		__assign_str(step_no, step_no);
+		__entry->function = function;
+		__entry->value = value;
+		__entry->requested_ms = requested_ms;
+		__entry->actual_us = actual_us;
+	),
+
+	TP_printk("%s step %s function=%d value=%d requested=%dms actual=%lldus",
+		__get_str(periph), __get_str(step_no), __entry->function,
+		__entry->value, __entry->requested_ms, __entry->actual_us)
+);
+
+TRACE_EVENT(indigo_status_wait,
+
+	TP_PROTO(const char *periph, int expected, int status,
+		int timeout_ms, s64 waited_us),
+
+	TP_ARGS(periph, expected, status, timeout_ms, waited_us),
+
+	TP_STRUCT__entry(
+		__string(periph, periph)
+		__field(int, expected)
+		__field(int, status)
+		__field(int, timeout_ms)
+		__field(s64, waited_us)
+	),
+
+	TP_fast_assign(
+		__assign_str(periph, periph);
+		__entry->expected = expected;
+		__entry->status = status;
+		__entry->timeout_ms = timeout_ms;
+		__entry->waited_us = waited_us;
+	),
+
+	TP_printk("%s expected=%d status=%d waited=%lldus timeout=%dms%s",
+		__get_str(periph), __entry->expected, __entry->status,
+		__entry->waited_us, __entry->timeout_ms,
+		__entry->status != __entry->expected ? " TIMEOUT" : "")
+);
+
+/* pin value is only read when the event is enabled */
+TRACE_EVENT(indigo_pin_irq,
+
+	TP_PROTO(const struct indigo_periph_pin *pin),
+
+	TP_ARGS(pin),
+
+	TP_STRUCT__entry(
+		__string(pin, pin->schematics_name)
+		__field(int, pin_no)
+		__field(int, value)
+	),
+
+	TP_fast_assign(
+		__assign_str(pin, pin->schematics_name);
+		__entry->pin_no = pin->pin_no;
+		__entry->value = gpio_get_value(pin->pin_no);
+	),
+
+	TP_printk("%s gpio=%d value=%d", __get_str(pin), __entry->pin_no,
+		__entry->value)
+);
+
+#endif /* _TRACE_INDIGO_GPIOPERIPH_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE indigo_gpioperiph
+#include <trace/define_trace.h>
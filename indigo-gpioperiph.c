@@ -1,28 +1,82 @@
+#include <linux/async.h>
+#include <linux/completion.h>
+#include <linux/debugfs.h>
 #include <linux/delay.h>
+#include <linux/dma-mapping.h>
+#include <linux/fs.h>
 #include <linux/hardirq.h>
+#include <linux/hrtimer.h>
 #include <linux/init.h>
 #include <linux/interrupt.h>
 #include <linux/kernel.h>
+#include <linux/kfifo.h>
 #include <linux/kobject.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
 #include <linux/memory.h>
+#include <linux/miscdevice.h>
 #include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
 #include <linux/platform_device.h>
+#include <linux/poll.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
+#include <linux/sort.h>
 #include <linux/spinlock.h>
 #include <linux/string.h>
 #include <linux/sysfs.h>
+#include <linux/uaccess.h>
 #include <linux/workqueue.h>
 
 #include <asm/gpio.h>
 
 #include <linux/indigo-gpioperiph.h>
 
+#define CREATE_TRACE_POINTS
+#include <trace/events/indigo_gpioperiph.h>
+
 static uint8_t do_debug_output = 0;
 
 module_param_named(debug, do_debug_output, byte, S_IRUGO | S_IWUSR);
 MODULE_PARM_DESC(debug, "Do debug output");
 
+static uint8_t use_hrtimer_engine = 0;
+
+module_param_named(hrtimer_engine, use_hrtimer_engine, byte, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(hrtimer_engine, "Time sequence steps with hrtimers instead of msleep");
+
+static uint8_t sleep_compensation = 1;
+
+module_param(sleep_compensation, byte, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(sleep_compensation, "Shorten msleep() by its measured overshoot, sleeps never get shorter than requested");
+
+static uint8_t record_waveform = 0;
+
+module_param_named(waveform, record_waveform, byte, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(waveform, "Record output writes and input edges for debugfs waveform.vcd");
+
+static int rt_priority = 0;
+
+module_param(rt_priority, int, S_IRUGO);
+MODULE_PARM_DESC(rt_priority, "SCHED_FIFO priority of command execution, one thread per peripheral; 0 -- shared workqueue, no threads");
+
+static int max_queue_depth = 8;
+
+module_param(max_queue_depth, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(max_queue_depth, "Unfinished commands per peripheral before -EBUSY");
+
+/*
+ * One pool for every peripheral: command queues (run_work) and keep-on
+ * checks; pin notifications are done in IRQ threads. Non-reentrant, so run_work of a
+ * peripheral never runs on two CPUs and its commands stay serialized.
+ * With rt_priority set command queues run elsewhere, see indigo_rt_thread_fn().
+ */
+static struct workqueue_struct *indigo_wq;
+
+/* boot time reports are relative to this */
+static ktime_t indigo_enable_time;
+
 #define PRINT(log_flag, format, args...)		\
 	if (unlikely(do_debug_output))			\
 		printk(log_flag format "\n", ## args)
@@ -63,18 +117,13 @@ MODULE_PARM_DESC(debug, "Do debug output");
         }                                                       \
 } while (0)
 
-static struct kmem_cache *indigo_cmd_mem_cache = NULL;
-
-int indigo_gpioperiph_get_pin_by_function(struct gpio_peripheral *periph,
-					enum indigo_pin_function_t function)
+/* linear scan of pins[], only used to build the index and before it exists */
+static int indigo_gpioperiph_scan_pin_by_function(struct gpio_peripheral *periph,
+						enum indigo_pin_function_t function)
 {
 	int i;
 	int pin_found = INDIGO_NO_PIN;
 
-	TRACE_ENTRY();
-
-	sBUG_ON(periph == NULL);
-
 	for (i = 0; i < INDIGO_MAX_GPIOPERIPH_PIN_COUNT; i++) {
 		if (periph->pins[i].function == function) {
 			pin_found = i;
@@ -85,7 +134,48 @@ int indigo_gpioperiph_get_pin_by_function(struct gpio_peripheral *periph,
 			break;
 	}
 
-	TRACE_EXIT_RES(pin_found);
+	return pin_found;
+}
+
+/*
+ * Fill function -> pin index of @periph. Must be called before
+ * anybody else can see @periph, pins[] are not supposed to change after.
+ */
+static void indigo_gpioperiph_build_pin_index(struct gpio_peripheral *periph)
+{
+	int function;
+
+	TRACE_ENTRY();
+
+	sBUG_ON(periph == NULL);
+
+	for (function = 0; function < INDIGO_FUNCTION_COUNT; function++)
+		periph->function_pins[function] =
+			indigo_gpioperiph_scan_pin_by_function(periph, function);
+
+	atomic_set(&periph->pin_lookups, 0);
+	atomic_set(&periph->pin_lookup_misses, 0);
+	periph->pin_index_ready = true;
+
+	TRACE_EXIT();
+}
+
+int indigo_gpioperiph_get_pin_by_function(struct gpio_peripheral *periph,
+					enum indigo_pin_function_t function)
+{
+	int pin_found;
+
+	sBUG_ON(periph == NULL);
+
+	atomic_inc(&periph->pin_lookups);
+
+	if (likely(periph->pin_index_ready && function < INDIGO_FUNCTION_COUNT)) {
+		pin_found = periph->function_pins[function];
+	} else {
+		atomic_inc(&periph->pin_lookup_misses);
+		pin_found = indigo_gpioperiph_scan_pin_by_function(periph, function);
+	}
+
 	/* maybe this pin is not that crucial */
 	return pin_found;
 }
@@ -97,8 +187,6 @@ int indigo_gpioperiph_get_mandatory_pin_by_function(struct gpio_peripheral *peri
 {
 	int pin = 0;
 
-	TRACE_ENTRY();
-
 	sBUG_ON(periph == NULL);
 
 	pin = indigo_gpioperiph_get_pin_by_function(periph, function);
@@ -109,32 +197,347 @@ int indigo_gpioperiph_get_mandatory_pin_by_function(struct gpio_peripheral *peri
 			function, periph->description);
 	}
 
-	TRACE_EXIT();
-
 	return pin;
 }
 
-/* нужно просто <s>хорошо работать</s> сказать sysfs_notify на нужный объект */
-static irqreturn_t indigo_pin_notify_change_handler(int irq, void *priv)
+/*
+ * Waveform recorder: output writes and input edges of all peripherals
+ * in one ring, exported as VCD by debugfs indigo/waveform.vcd
+ */
+#define INDIGO_WAVEFORM_SIZE 512
+/* VCD identifiers are single printable characters from '!' */
+#define INDIGO_WAVEFORM_SIGNALS 64
+
+struct indigo_waveform_event {
+	ktime_t time;
+	const struct indigo_periph_pin *pin;
+	int level; /* on the wire, GPIOF_ACTIVE_LOW not applied */
+};
+
+static struct indigo_waveform_event indigo_waveform[INDIGO_WAVEFORM_SIZE];
+static unsigned int indigo_waveform_next;
+static DEFINE_SPINLOCK(indigo_waveform_lock);
+
+/*
+ * context: any, hard IRQ included
+ *
+ * The time is taken under the lock, so the ring stays ordered by time
+ * and waveform.vcd never goes back.
+ */
+static void indigo_waveform_record(const struct indigo_periph_pin *pin, int level)
 {
-	struct work_struct *work = priv;
+	struct indigo_waveform_event *event;
+	unsigned long flags = 0;
 
+	if (likely(!record_waveform))
+		return;
 
-	(void) irq;
-	/* printk(KERN_ERR "I'm here! %s\n", pin->schematics_name); */
-	schedule_work(work);
+	spin_lock_irqsave(&indigo_waveform_lock, flags);
+	event = &indigo_waveform[indigo_waveform_next % INDIGO_WAVEFORM_SIZE];
+	indigo_waveform_next++;
+	event->time = ktime_get();
+	event->pin = pin;
+	event->level = level;
+	spin_unlock_irqrestore(&indigo_waveform_lock, flags);
+}
 
-	return IRQ_HANDLED;
+/*
+ * Event stream of /dev/indigo_events, filled from hard IRQ halves.
+ * The size is a power of two, as kfifo wants.
+ */
+#define INDIGO_EVENTS_SIZE 256
+
+static DEFINE_KFIFO(indigo_events, struct indigo_pin_event, INDIGO_EVENTS_SIZE);
+static DEFINE_SPINLOCK(indigo_events_lock);
+static DECLARE_WAIT_QUEUE_HEAD(indigo_events_wait);
+static u32 indigo_events_dropped; /* under indigo_events_lock */
+
+/* context: hard IRQ */
+static void indigo_events_push(const struct indigo_periph_pin *pin)
+{
+	struct indigo_pin_event event;
+	unsigned long flags = 0;
+
+	strlcpy(event.peripheral, pin->periph->name, sizeof(event.peripheral));
+	event.pin = pin - pin->periph->pins;
+	event.value = pin->edge_level != 0;
+	event.reserved = 0;
+	event.time_ns = ktime_to_ns(pin->edge_time);
+
+	spin_lock_irqsave(&indigo_events_lock, flags);
+	event.dropped = indigo_events_dropped;
+	if (kfifo_in(&indigo_events, &event, 1) == 1)
+		indigo_events_dropped = 0;
+	else
+		indigo_events_dropped++;
+	spin_unlock_irqrestore(&indigo_events_lock, flags);
+
+	wake_up_interruptible(&indigo_events_wait);
+}
+
+/*
+ * State page of /dev/indigo, see struct indigo_state_page. It's
+ * DMA-coherent, i.e. uncached memory: the kernel and user mappings
+ * would alias in the VIVT cache otherwise.
+ */
+static struct indigo_state_page *indigo_state;
+static dma_addr_t indigo_state_dma;
+static DEFINE_SPINLOCK(indigo_state_lock);
+
+/* context: any. NULL if @obj has no slot, otherwise indigo_state_end() it */
+static struct indigo_state_periph *indigo_state_begin(struct gpio_peripheral_obj *obj,
+						unsigned long *flags)
+{
+	if (obj->state == NULL)
+		return NULL;
+
+	spin_lock_irqsave(&indigo_state_lock, *flags);
+	indigo_state->seq++;
+	wmb();
+
+	return obj->state;
+}
+
+static void indigo_state_end(unsigned long *flags)
+{
+	wmb();
+	indigo_state->seq++;
+	spin_unlock_irqrestore(&indigo_state_lock, *flags);
+}
+
+static void indigo_state_add_peripheral(struct gpio_peripheral_obj *obj)
+{
+	struct indigo_state_periph *state;
+	unsigned long flags = 0;
+
+	if (indigo_state == NULL)
+		return;
+
+	spin_lock_irqsave(&indigo_state_lock, flags);
+	if (indigo_state->count < INDIGO_STATE_MAX_PERIPHS) {
+		state = &indigo_state->periphs[indigo_state->count];
+		strlcpy(state->name, obj->peripheral.name, sizeof(state->name));
+		state->status = INDIGO_STATUS_UNKNOWN;
+		obj->state = state;
+
+		/* readers only look at count periphs, no seq bump needed */
+		wmb();
+		indigo_state->count++;
+	}
+	spin_unlock_irqrestore(&indigo_state_lock, flags);
+}
+
+/* context: any, @level is on the wire */
+static void indigo_state_set_pin(struct gpio_peripheral_obj *obj, int pin, int level)
+{
+	struct indigo_state_periph *state;
+	unsigned long flags = 0;
+
+	state = indigo_state_begin(obj, &flags);
+	if (state == NULL)
+		return;
+
+	if (level)
+		state->pins |= 1U << pin;
+	else
+		state->pins &= ~(1U << pin);
+	state->pins_valid |= 1U << pin;
+
+	indigo_state_end(&flags);
+}
+
+/* context: any, status_lock held for writing */
+static void indigo_state_set_status(struct gpio_peripheral_obj *obj, int status)
+{
+	struct indigo_state_periph *state;
+	unsigned long flags = 0;
+
+	state = indigo_state_begin(obj, &flags);
+	if (state == NULL)
+		return;
+
+	state->status = status;
+	indigo_state_end(&flags);
+}
+
+static void indigo_state_set_flags(struct gpio_peripheral_obj *obj)
+{
+	struct indigo_state_periph *state;
+	unsigned long flags = 0;
+
+	state = indigo_state_begin(obj, &flags);
+	if (state == NULL)
+		return;
+
+	state->flags = (obj->peripheral.flags & GPIO_PERIPH_FLAG_KEEP_ON) ?
+		INDIGO_STATE_KEEP_ON : 0;
+	indigo_state_end(&flags);
+}
+
+/* context: command_lock held */
+static void indigo_state_set_commands(struct gpio_peripheral_obj *obj)
+{
+	struct indigo_state_periph *state;
+	unsigned long flags = 0;
+
+	state = indigo_state_begin(obj, &flags);
+	if (state == NULL)
+		return;
+
+	state->pending = atomic_read(&obj->pending);
+	state->running_id = obj->running != NULL ? obj->running->id : 0;
+	state->running_cmd = obj->running != NULL ?
+		obj->running->cmd : INDIGO_COMMAND_NO_COMMAND;
+	state->last_id = obj->last_id;
+	state->last_cmd = obj->last_cmd;
+	state->last_result = obj->last_result;
+	indigo_state_end(&flags);
+}
+
+static bool indigo_pin_edge_wanted(const struct indigo_periph_pin *pin, int level)
+{
+	switch (pin->flags & GPIOF_EDGE_MASK) {
+	case GPIOF_EDGE_RISING:
+		return level != 0;
+	case GPIOF_EDGE_FALLING:
+		return level == 0;
+	default:
+		return true;
+	}
+}
+
+/* minimal distance between two level changes, 0 -- not limited */
+static int indigo_pin_filter_interval_ms(const struct indigo_periph_pin *pin)
+{
+	int interval = max(pin->debounce_ms, 0);
+
+	if (pin->max_rate_hz > 0)
+		interval = max_t(int, interval, DIV_ROUND_UP(MSEC_PER_SEC, pin->max_rate_hz));
+
+	return interval;
+}
+
+/*
+ * context: hard IRQ or settle timer, filter_lock held
+ *
+ * Decides whether the line being at @level is worth reporting. Changes
+ * inside the window are dropped and the settle timer is armed to look
+ * at the line once the window is over, so the final level is never lost.
+ */
+static bool indigo_pin_filter(struct indigo_periph_pin *pin, int level, ktime_t now)
+{
+	int interval = indigo_pin_filter_interval_ms(pin);
+	s64 elapsed_ms;
+
+	/* unfiltered, but the state stays right for when filtering is set */
+	if (interval == 0 && (pin->flags & GPIOF_EDGE_MASK) == GPIOF_EDGE_BOTH) {
+		pin->last_level = level;
+		pin->last_change = now;
+		return true;
+	}
+
+	if (level == pin->last_level)
+		return false;
+
+	if (interval > 0) {
+		elapsed_ms = ktime_to_ms(ktime_sub(now, pin->last_change));
+		if (elapsed_ms < interval) {
+			mod_timer(&pin->settle_timer,
+				jiffies + msecs_to_jiffies(interval - elapsed_ms) + 1);
+			return false;
+		}
+	}
+
+	pin->last_level = level;
+	pin->last_change = now;
+
+	return indigo_pin_edge_wanted(pin, level);
 }
 
-static void indigo_pin_notify_sysfs(struct work_struct *work)
+/* context: IRQ thread or settle timer */
+static void indigo_pin_report(struct indigo_periph_pin *pin)
 {
-	struct indigo_periph_pin *pin = container_of(work, struct indigo_periph_pin, work);
+	struct gpio_peripheral_obj *obj;
+
+	obj = container_of(pin->periph, struct gpio_peripheral_obj, peripheral);
+	atomic_inc(&obj->stats.pin_irqs[pin - pin->periph->pins]);
+
+	trace_indigo_pin_irq(pin);
 
 	if (pin->value_sd != NULL)
 		sysfs_notify_dirent(pin->value_sd);
 }
 
+/* context: hard IRQ or settle timer, filter_lock held */
+static bool indigo_pin_edge(struct indigo_periph_pin *pin)
+{
+	ktime_t now = ktime_get();
+	int level = gpio_get_value(pin->pin_no);
+
+	if (!indigo_pin_filter(pin, level, now))
+		return false;
+
+	pin->edge_time = now;
+	pin->edge_level = level;
+	indigo_waveform_record(pin, level);
+	indigo_events_push(pin);
+	indigo_state_set_pin(container_of(pin->periph, struct gpio_peripheral_obj, peripheral),
+			pin - pin->periph->pins, level);
+
+	return true;
+}
+
+/*
+ * Pin IRQs are threaded: the hard half only remembers when the edge
+ * happened and what level it left, the thread does the rest. Edges
+ * the filter drops don't wake the thread at all.
+ */
+static irqreturn_t indigo_pin_edge_hardirq(int irq, void *priv)
+{
+	struct indigo_periph_pin *pin = priv;
+	struct gpio_peripheral_obj *obj;
+	bool report;
+
+	(void) irq;
+
+	spin_lock(&pin->filter_lock);
+	report = indigo_pin_edge(pin);
+	spin_unlock(&pin->filter_lock);
+
+	if (!report) {
+		obj = container_of(pin->periph, struct gpio_peripheral_obj, peripheral);
+		atomic_inc(&obj->stats.pin_filtered[pin - pin->periph->pins]);
+		return IRQ_HANDLED;
+	}
+
+	return IRQ_WAKE_THREAD;
+}
+
+/* нужно просто <s>хорошо работать</s> сказать sysfs_notify на нужный объект */
+static irqreturn_t indigo_pin_notify_change_handler(int irq, void *priv)
+{
+	(void) irq;
+
+	indigo_pin_report(priv);
+
+	return IRQ_HANDLED;
+}
+
+/* the debounce/rate window is over, report the level the line settled at */
+static void indigo_pin_settle_timer_fn(unsigned long data)
+{
+	struct indigo_periph_pin *pin = (struct indigo_periph_pin *) data;
+	unsigned long flags = 0;
+	bool report;
+
+	spin_lock_irqsave(&pin->filter_lock, flags);
+	report = indigo_pin_edge(pin);
+	spin_unlock_irqrestore(&pin->filter_lock, flags);
+
+	if (report)
+		indigo_pin_report(pin);
+}
+
 /* смысл, в основном, в том, чтобы дополнить разницу
  * между общими функциями gpio_* и атмеловские at91_*
  */
@@ -257,6 +660,87 @@ int indigo_configure_general_pins(struct gpio_peripheral *periph)
 }
 EXPORT_SYMBOL(indigo_configure_general_pins);
 
+/*
+ * Status cache. A status that follows a status pin can only be trusted
+ * while the status IRQ keeps it up to date; one derived from outputs
+ * only changes when we write them, see indigo_status_invalidate().
+ */
+static bool indigo_status_cacheable(struct gpio_peripheral_obj *obj)
+{
+	return obj->status_irq || (obj->peripheral.pin_index_ready &&
+		obj->peripheral.function_pins[INDIGO_FUNCTION_STATUS] == INDIGO_NO_PIN);
+}
+
+/* context: any */
+static void indigo_status_invalidate(struct gpio_peripheral_obj *obj)
+{
+	unsigned long flags = 0;
+
+	write_seqlock_irqsave(&obj->status_lock, flags);
+	obj->status_gen++;
+	obj->status_cache = INDIGO_STATUS_UNKNOWN;
+	indigo_state_set_status(obj, obj->status_cache);
+	write_sequnlock_irqrestore(&obj->status_lock, flags);
+}
+
+/* context: any, @status is what periph->status() has just returned */
+static void indigo_status_set(struct gpio_peripheral_obj *obj, int status)
+{
+	unsigned long flags = 0;
+
+	write_seqlock_irqsave(&obj->status_lock, flags);
+	obj->status_gen++;
+	obj->status_cache = indigo_status_cacheable(obj) ? status : INDIGO_STATUS_UNKNOWN;
+	indigo_state_set_status(obj, obj->status_cache);
+	write_sequnlock_irqrestore(&obj->status_lock, flags);
+}
+
+/* lock-free unless the cache is cold, then it's a GPIO read and a fill */
+static int indigo_peripheral_status(struct gpio_peripheral_obj *obj)
+{
+	struct gpio_peripheral *periph = &obj->peripheral;
+	unsigned long flags = 0;
+	unsigned int seq;
+	unsigned int gen;
+	int status;
+
+	do {
+		seq = read_seqbegin(&obj->status_lock);
+		status = obj->status_cache;
+		gen = obj->status_gen;
+	} while (read_seqretry(&obj->status_lock, seq));
+
+	if (status != INDIGO_STATUS_UNKNOWN)
+		return status;
+
+	status = periph->status(periph);
+
+	write_seqlock_irqsave(&obj->status_lock, flags);
+	if (obj->status_gen == gen && indigo_status_cacheable(obj)) {
+		obj->status_cache = status;
+		indigo_state_set_status(obj, status);
+	}
+	write_sequnlock_irqrestore(&obj->status_lock, flags);
+
+	return status;
+}
+
+/*
+ * context: any, hrtimer callback included: no lookups, no checks, no
+ * printk. @level is on the wire.
+ */
+static void indigo_gpioperiph_write_pin(struct gpio_peripheral *periph, int pin, int level)
+{
+	struct gpio_peripheral_obj *obj;
+
+	obj = container_of(periph, struct gpio_peripheral_obj, peripheral);
+
+	gpio_set_value(periph->pins[pin].pin_no, level);
+	indigo_waveform_record(&periph->pins[pin], level);
+	indigo_state_set_pin(obj, pin, level);
+	indigo_status_invalidate(obj);
+}
+
 /**
  * only valid for output pins
  *
@@ -268,13 +752,13 @@ static void indigo_gpioperiph_set_output(struct gpio_peripheral *periph,
 					bool mandatory)
 {
 	int pin;
+	int level;
 
 	pin = indigo_gpioperiph_get_mandatory_pin_by_function(periph, function, mandatory);
 
-	if (pin == INDIGO_NO_PIN) {
-		PRINT(KERN_INFO, "non-mandatory pin for function %d not found\n", function);
+	/* non-mandatory pin is not there */
+	if (pin == INDIGO_NO_PIN)
 		goto done;
-	}
 
 	/* otherwise, there'll be panic */
 
@@ -284,683 +768,967 @@ static void indigo_gpioperiph_set_output(struct gpio_peripheral *periph,
 		goto done;
 	}
 
-	gpio_set_value(periph->pins[pin].pin_no,
-		indigo_pin_active_value(&periph->pins[pin], value));
+	level = indigo_pin_active_value(&periph->pins[pin], value);
+	indigo_gpioperiph_write_pin(periph, pin, level);
 
 done:
 	return;
 }
 
-/**
- * @step_count == ARRAY_SIZE(steps)
- *
- * context: !in_atomic()
+static inline ktime_t indigo_ktime_add_ms(ktime_t kt, int ms)
+{
+	return ktime_add_ns(kt, (u64) ms * NSEC_PER_MSEC);
+}
+
+/*
+ * log2 latency histograms, see latency file in debugfs
  *
- * @INDIGO_FUNCTION_STATUS as pin kind is handled by timeout
+ * bucket 0 counts everything below 1 unit, bucket N -- [2^(N-1), 2^N),
+ * the last one also counts everything longer.
  */
-static int indigo_gpio_perform_sequence(struct indigo_gpio_sequence_step *steps,
-					int step_count)
+static void indigo_latency_add(struct indigo_latency_hist *hist, s64 value)
 {
-	int i;
-	int result = 0;
-	int status;
-	int timeout;
+	int bucket = 0;
 
-	for (i = 0; i < step_count; i++) {
-		TRACE_STEP(steps[i].step_no, steps[i].step_desc);
+	if (value > 0)
+		bucket = fls(min_t(s64, value, INT_MAX));
 
-		/* last step indicator */
-		if (steps[i].periph == NULL)
-			goto out;
+	if (bucket >= INDIGO_LATENCY_BUCKETS)
+		bucket = INDIGO_LATENCY_BUCKETS - 1;
 
-		/* function is not mandatory when it's just a timeout waiting */
-		if (steps[i].function != INDIGO_FUNCTION_NO_FUNCTION &&
-			steps[i].function != INDIGO_FUNCTION_STATUS) {
+	atomic_inc(&hist->buckets[bucket]);
+	atomic_inc(&hist->count);
+}
 
-			indigo_gpioperiph_set_output(steps[i].periph,
-						steps[i].function, steps[i].value, steps[i].mandatory);
-		}
+static void indigo_latency_record(struct indigo_latency_hist *hist, ktime_t from, ktime_t to)
+{
+	indigo_latency_add(hist, ktime_to_ms(ktime_sub(to, from)));
+}
 
-		if (steps[i].sleep_ms != 0)
-			msleep(steps[i].sleep_ms);
-
-		timeout = 0;
-		/* only timeout on status function available */
-		if (steps[i].timeout_ms != 0 && steps[i].function == INDIGO_FUNCTION_STATUS) {
-			status = steps[i].periph->status(steps[i].periph);
-			/* wait for given status value if INDIGO_FUNCTION_STATUS happened*/
-			while (timeout < steps[i].timeout_ms && (status != steps[i].value)) {
-				msleep(500);
-				timeout = timeout + 500;
-				status = steps[i].periph->status(steps[i].periph);
-			}
-			result = !status;
-		}
+/* upper bound of the bucket holding @percent percentile, in the histogram's units */
+static unsigned int indigo_latency_percentile(struct indigo_latency_hist *hist, int percent)
+{
+	int count = atomic_read(&hist->count);
+	int target = DIV_ROUND_UP(count * percent, 100);
+	int seen = 0;
+	int i;
+
+	if (count == 0)
+		return 0;
+
+	for (i = 0; i < INDIGO_LATENCY_BUCKETS - 1; i++) {
+		seen += atomic_read(&hist->buckets[i]);
+		if (seen >= target)
+			break;
 	}
 
-out:
-	TRACE_EXIT_RES(result);
-	return result;
+	return 1U << i;
 }
 
-/* general GSM routines */
-
-/**
- * Returns status pin value w/o interpretation
- */
-static int gsm_generic_status(struct gpio_peripheral *periph)
+/* output part of a sequence step */
+static void indigo_gpio_step_output(struct indigo_gpio_sequence_step *step)
 {
-	int status_pin = indigo_gpioperiph_get_pin_by_function(periph,
-							INDIGO_FUNCTION_STATUS);
+	/* function is not mandatory when it's just a timeout waiting */
+	if (step->function != INDIGO_FUNCTION_NO_FUNCTION &&
+		step->function != INDIGO_FUNCTION_STATUS) {
 
-	return indigo_pin_active_value(
-		&periph->pins[status_pin],
-		gpio_get_value(periph->pins[status_pin].pin_no));
+		indigo_gpioperiph_set_output(step->periph,
+					step->function, step->value, step->mandatory);
+	}
 }
 
-static struct completion *indigo_peripheral_create_command(struct gpio_peripheral *peripheral,
-							enum indigo_gpioperiph_command_t command);
-
+/* how long an output step holds its value: sleep_ms, min_ms is a floor */
+static inline int indigo_gpio_step_hold_ms(const struct indigo_gpio_sequence_step *step)
+{
+	return max(step->sleep_ms, step->min_ms);
+}
 
-static irqreturn_t keep_turned_on_handler_irq(int irq, void *dev)
+/* context: any */
+static void indigo_gpio_check_window(struct indigo_gpio_sequence_step *step,
+				s64 actual_us)
 {
-	struct gpio_peripheral *device = (struct gpio_peripheral *) dev;
 	struct gpio_peripheral_obj *obj;
+	bool short_step;
 
-	(void)irq;
+	/* status steps sleep up to min_ms on their own */
+	short_step = step->function != INDIGO_FUNCTION_STATUS &&
+		actual_us < (s64) step->min_ms * USEC_PER_MSEC;
 
-	TRACE_ENTRY();
+	if (!short_step &&
+		(step->max_ms == 0 || actual_us <= (s64) step->max_ms * USEC_PER_MSEC))
+		return;
 
-	obj = container_of(device, struct gpio_peripheral_obj, peripheral);
+	obj = container_of(step->periph, struct gpio_peripheral_obj, peripheral);
+	atomic_inc(&obj->stats.window_violations);
 
-	schedule_work(&obj->check_status_work);
-	/*
-	 * schedule a check of device status at the end of command queue
-	 * and turn it on if status is 0 that time
-	 */
+	if (printk_ratelimit())
+		printk(KERN_WARNING "%s: step %s \"%s\" took %lld us, window %d..%d ms\n",
+			step->periph->name, step->step_no, step->step_desc,
+			actual_us, step->min_ms, step->max_ms);
+}
 
-	TRACE_EXIT();
+static int indigo_u32_cmp(const void *a, const void *b)
+{
+	u32 x = *(const u32 *) a;
+	u32 y = *(const u32 *) b;
 
-	return IRQ_HANDLED;
+	return x < y ? -1 : x > y;
 }
 
-static void indigo_check_status(struct work_struct *work)
+/* p99 of time-to-status, 0 if there's not enough samples yet */
+static u32 indigo_learned_p99(struct gpio_peripheral_obj *obj, int value)
 {
-	struct gpio_peripheral_obj *peripheral_obj = NULL;
-	struct gpio_peripheral *device = NULL;
-	TRACE_ENTRY();
+	struct indigo_learned_timeout *learned = &obj->learned[value != 0];
+	u32 samples[INDIGO_LEARN_SAMPLES];
+	unsigned int count;
 
-	peripheral_obj = container_of(work, struct gpio_peripheral_obj, check_status_work);
-	device = &peripheral_obj->peripheral;
+	spin_lock_irq(&obj->timing_lock);
+	count = learned->count;
+	memcpy(samples, learned->samples_ms, sizeof(samples));
+	spin_unlock_irq(&obj->timing_lock);
 
-	PRINT(KERN_INFO, "status reading is %d\n", device->status(device));
-	if (!device->status(device))
-		indigo_peripheral_create_command(device, INDIGO_COMMAND_CHECK_AND_POWER_ON);
+	if (count < INDIGO_LEARN_MIN_SAMPLES)
+		return 0;
 
-	TRACE_EXIT();
-	return;
+	count = min_t(unsigned int, count, INDIGO_LEARN_SAMPLES);
+	sort(samples, count, sizeof(samples[0]), indigo_u32_cmp, NULL);
+
+	return samples[DIV_ROUND_UP(count * 99, 100) - 1];
 }
 
-/* шлём либо NULL, либо keen_turned_on_handler_irq */
-static int indigo_set_keep_on_handler(struct gpio_peripheral *periph,
-				irq_handler_t status_pin_handler)
+static void indigo_learned_add(struct gpio_peripheral_obj *obj, int value,
+			u32 sample_ms, bool missed)
 {
-	int status;
-	int result = 0;
-
-	TRACE_ENTRY();
+	struct indigo_learned_timeout *learned = &obj->learned[value != 0];
+
+	spin_lock_irq(&obj->timing_lock);
+	learned->samples_ms[learned->next] = sample_ms;
+	learned->next = (learned->next + 1) % INDIGO_LEARN_SAMPLES;
+	learned->count++;
+	if (missed)
+		learned->misses++;
+	spin_unlock_irq(&obj->timing_lock);
+}
 
-	sBUG_ON(periph == NULL);
+static int indigo_peripheral_abort_reason(struct gpio_peripheral *periph);
 
-	status = indigo_gpioperiph_get_pin_by_function(periph, INDIGO_FUNCTION_STATUS);
-	if (status == INDIGO_NO_PIN) {
-		result = -ENOENT;
-		goto out;
-	};
+/*
+ * wait up to @timeout_ms for status to become @step->value, returns status;
+ * gives up early if the command is aborted
+ */
+static int indigo_gpio_wait_status_for(struct indigo_gpio_sequence_step *step,
+				int timeout_ms, int poll_ms)
+{
+	struct gpio_peripheral *periph = step->periph;
+	struct gpio_peripheral_obj *obj;
+	int status;
+	int timeout = 0;
 
-	if ((status_pin_handler != NULL) && (periph->flags & GPIO_PERIPH_FLAG_KEEP_ON) == 0) {
-		if (request_irq(gpio_to_irq(periph->pins[status].pin_no),
-					status_pin_handler,
-					IRQF_TRIGGER_FALLING | IRQF_TRIGGER_RISING,
-					periph->pins[status].description, (void *) periph)) {
+	obj = container_of(periph, struct gpio_peripheral_obj, peripheral);
 
-			printk(KERN_ERR "can not request irq for status pin\n");
-			panic("can not request irq for status pin\n");
-		}
-		periph->flags |= GPIO_PERIPH_FLAG_KEEP_ON;
-	} else if (status_pin_handler == NULL && (periph->flags & GPIO_PERIPH_FLAG_KEEP_ON) != 0) {
-		/* если не проверять состояние, можем влететь в двойной free_irq */
-		free_irq(gpio_to_irq(periph->pins[status].pin_no), (void *) periph);
+	if (obj->status_irq) {
+		/* status pin edge wakes us up, no need to poll */
+		wait_event_timeout(obj->status_wait,
+				periph->status(periph) == step->value ||
+				indigo_peripheral_abort_reason(periph) != 0,
+				msecs_to_jiffies(timeout_ms));
+		return periph->status(periph);
+	}
 
-		periph->flags &= ~GPIO_PERIPH_FLAG_KEEP_ON;
+	status = periph->status(periph);
+	while (timeout < timeout_ms && (status != step->value)) {
+		if (indigo_peripheral_abort_reason(periph) != 0)
+			break;
 
+		msleep(poll_ms);
+		timeout = timeout + poll_ms;
+		status = periph->status(periph);
 	}
-out:
-	TRACE_EXIT_RES(result);
-	return result;
+
+	return status;
 }
 
-/**
- * Configure status pin for given interrupt handler, a pwrkey pin
- * and power pin if one's available
+/*
+ * wait for given status value if INDIGO_FUNCTION_STATUS happened,
+ * returns @result unchanged for every other step
  *
- * All supported modems have at least two functional pins --
- * pwr_key and status pin. Our schematics has a power pin to
- * physically turn off the device.
+ * Once there's enough history, the first wait is p99 of learned
+ * time-to-status plus a margin, polled finer. Only if it runs out we
+ * escalate to the full timeout_ms from the table.
+ *
+ * context: !in_atomic()
  */
-static int gsm_generic_simcom_setup(struct gpio_peripheral *periph,
-				irq_handler_t status_pin_handler)
+static int indigo_gpio_step_wait_status(struct indigo_gpio_sequence_step *step,
+					int result)
 {
-	int result = 0;
+	struct gpio_peripheral *periph = step->periph;
+	struct gpio_peripheral_obj *obj;
+	ktime_t start;
+	s64 elapsed_us;
+	int tight_ms;
 	int status;
+	bool missed = false;
+
+	/* only timeout on status function available */
+	if (step->timeout_ms == 0 || step->function != INDIGO_FUNCTION_STATUS)
+		return result;
+
+	obj = container_of(periph, struct gpio_peripheral_obj, peripheral);
+	start = ktime_get();
+
+	tight_ms = indigo_learned_p99(obj, step->value);
+	if (tight_ms != 0)
+		tight_ms += max_t(int, tight_ms / 4, INDIGO_LEARN_MARGIN_MS);
+
+	if (tight_ms != 0 && tight_ms < step->timeout_ms) {
+		status = indigo_gpio_wait_status_for(step, tight_ms,
+						clamp_t(int, tight_ms / 16, 20, 500));
+		if (status != step->value && indigo_peripheral_abort_reason(periph) == 0) {
+			/* counted in learned[].misses, see indigo_learned_add() */
+			missed = true;
+			status = indigo_gpio_wait_status_for(step,
+							step->timeout_ms - tight_ms, 500);
+		}
+	} else {
+		status = indigo_gpio_wait_status_for(step, step->timeout_ms, 500);
+	}
 
-	TRACE_ENTRY();
+	if (indigo_peripheral_abort_reason(periph) != 0) {
+		/* neither a timeout nor a sample */
+		status = periph->status(periph);
+		goto out;
+	} else if (status != step->value) {
+		atomic_inc(&obj->stats.status_timeouts);
+	} else {
+		elapsed_us = ktime_us_delta(ktime_get(), start);
+		indigo_learned_add(obj, step->value, div_s64(elapsed_us, USEC_PER_MSEC), missed);
+		indigo_gpio_check_window(step, elapsed_us);
+	}
 
-	/* we will not return from there if configuration has failed */
+	/* status is there early, but the step is not over yet */
+	elapsed_us = ktime_us_delta(ktime_get(), start);
+	if (elapsed_us < (s64) step->min_ms * USEC_PER_MSEC)
+		usleep_range((s64) step->min_ms * USEC_PER_MSEC - elapsed_us,
+			(s64) step->min_ms * USEC_PER_MSEC - elapsed_us + 100);
 
-	status = indigo_configure_pin(periph, INDIGO_FUNCTION_STATUS, /* mandatory */ true);
+out:
+	trace_indigo_status_wait(periph->name, step->value, status,
+				step->timeout_ms, ktime_us_delta(ktime_get(), start));
+	indigo_latency_record(&obj->latency[obj->running_cmd][INDIGO_LATENCY_STATUS_WAIT],
+			start, ktime_get());
+	return !status;
+}
 
-	periph->status = gsm_generic_status;
+static void indigo_gpio_record_step(struct indigo_gpio_sequence_step *step,
+				s64 actual_us)
+{
+	struct gpio_peripheral_obj *obj;
+	struct indigo_step_timing *timing = NULL;
+	unsigned long flags = 0;
+	s32 err_us = actual_us - (s64) indigo_gpio_step_hold_ms(step) * USEC_PER_MSEC;
+	int i;
 
-	if (status_pin_handler != NULL)
-		indigo_set_keep_on_handler(periph, status_pin_handler);
+	obj = container_of(step->periph, struct gpio_peripheral_obj, peripheral);
 
-	indigo_configure_pin(periph, INDIGO_FUNCTION_PWRKEY, /* mandatory */ true);
+	spin_lock_irqsave(&obj->timing_lock, flags);
+	for (i = 0; i < INDIGO_STEP_TIMING_SLOTS; i++) {
+		timing = &obj->step_timing[i];
+		if (timing->step_desc == step->step_desc || timing->step_desc == NULL)
+			break;
+	}
 
-	/* it doesn't really matter if it's not found */
-	indigo_configure_pin(periph, INDIGO_FUNCTION_POWER, /* mandatory */ false);
+	/* table is full, new steps are not accounted */
+	if (i == INDIGO_STEP_TIMING_SLOTS)
+		goto out;
 
-	TRACE_EXIT_RES(result);
-	return result;
+	if (timing->step_desc == NULL) {
+		timing->step_desc = step->step_desc;
+		timing->step_no = step->step_no;
+		timing->min_err_us = err_us;
+		timing->max_err_us = err_us;
+	}
+
+	timing->requested_ms = indigo_gpio_step_hold_ms(step);
+	timing->count++;
+	timing->last_err_us = err_us;
+	timing->min_err_us = min(timing->min_err_us, err_us);
+	timing->max_err_us = max(timing->max_err_us, err_us);
+	timing->sum_err_us += err_us;
+out:
+	spin_unlock_irqrestore(&obj->timing_lock, flags);
 }
 
-/* FIXME error handling through int result */
-static int indigo_generic_reset(struct gpio_peripheral *periph)
+static void indigo_gpio_trace_step_at(struct indigo_gpio_sequence_step *step,
+				ktime_t start, ktime_t now)
 {
-	int result = 0;
-
-	TRACE_ENTRY();
-
-	sBUG_ON(periph == NULL);
+	struct gpio_peripheral_obj *obj;
+	s64 actual_us = ktime_us_delta(now, start);
+	s64 overshoot_us;
 
-	TRACE_STEP("1", "restart");
-	if (periph->status(periph)) {
-		/* option 1. restart */
-		TRACE_STEP("1.1", "Power off");
+	obj = container_of(step->periph, struct gpio_peripheral_obj, peripheral);
 
-		result = periph->power_off(periph);
+	trace_indigo_sequence_step(step->periph->name, step->step_no,
+				step->function, step->value,
+				indigo_gpio_step_hold_ms(step), actual_us);
 
-		if (result) {
-			PRINT(KERN_ERR, "couldn't power off the device");
-			goto out;
-		}
-	}
+	if (indigo_gpio_step_hold_ms(step) != 0) {
+		indigo_gpio_record_step(step, actual_us);
 
-	TRACE_STEP("1.2", "Power on");
-	result = periph->power_on(periph);
-	if (result) {
-		PRINT(KERN_ERR, "couldn't power on the device");
-		goto out;
+		/* steps are ms long, their error is well below that */
+		overshoot_us = actual_us - (s64) indigo_gpio_step_hold_ms(step) * USEC_PER_MSEC;
+		if (overshoot_us < 0)
+			atomic_inc(&obj->step_early[obj->running_cmd]);
+		else
+			indigo_latency_add(&obj->step_overshoot[obj->running_cmd], overshoot_us);
 	}
 
-out:
-	TRACE_EXIT_RES(result);
-	return result;
+	indigo_gpio_check_window(step, actual_us);
 }
 
-int indigo_gpio_do_nothing(struct gpio_peripheral *periph)
+static inline void indigo_gpio_trace_step(struct indigo_gpio_sequence_step *step,
+					ktime_t start)
 {
-	TRACE_ENTRY();
-
-	(void) periph;
-
-	TRACE_EXIT_RES(0);
-	return 0;
+	indigo_gpio_trace_step_at(step, start, ktime_get());
 }
 
-/* заглушка для всяких BQ */
-int indigo_do_nothing_setup(struct gpio_peripheral *periph)
+/*
+ * msleep() ends a jiffy or two late. Sleep for less by the overshoot
+ * measured so far, then top up with usleep_range() if it woke up early,
+ * so the step still lasts at least its hold time.
+ */
+static void indigo_gpio_step_sleep(struct indigo_gpio_sequence_step *step,
+				ktime_t start)
 {
-	TRACE_ENTRY();
+	struct gpio_peripheral_obj *obj;
+	int hold_ms = indigo_gpio_step_hold_ms(step);
+	s64 requested_us = (s64) hold_ms * USEC_PER_MSEC;
+	s64 elapsed_us;
+	unsigned int sleep_ms;
+	int sample_us;
+
+	if (!sleep_compensation) {
+		msleep(hold_ms);
+		return;
+	}
 
-	periph->reset = indigo_gpio_do_nothing;
-	periph->power_on = indigo_gpio_do_nothing;
-	periph->power_off = indigo_gpio_do_nothing;
-	periph->check_and_power_on = indigo_gpio_do_nothing;
-	periph->status = indigo_gpio_do_nothing;
+	/* sequences of one peripheral never run concurrently */
+	obj = container_of(step->periph, struct gpio_peripheral_obj, peripheral);
 
-	TRACE_EXIT_RES(0);
-	return 0;
+	sleep_ms = hold_ms - min(hold_ms, max(obj->sleep_overshoot_us, 0) / (int) USEC_PER_MSEC);
+	if (sleep_ms != 0) {
+		msleep(sleep_ms);
+
+		sample_us = ktime_us_delta(ktime_get(), start) - (s64) sleep_ms * USEC_PER_MSEC;
+		obj->sleep_overshoot_us += (sample_us - obj->sleep_overshoot_us) / 8;
+	}
+
+	elapsed_us = ktime_us_delta(ktime_get(), start);
+	if (elapsed_us < requested_us)
+		usleep_range(requested_us - elapsed_us, requested_us - elapsed_us + 100);
 }
-EXPORT_SYMBOL(indigo_do_nothing_setup);
 
-static int indigo_check_and_power_on(struct gpio_peripheral *periph)
+static int indigo_gpio_perform_sequence_msleep(struct indigo_gpio_sequence_step *steps,
+					int step_count)
 {
+	int i;
 	int result = 0;
+	ktime_t start;
 
-	TRACE_ENTRY();
+	for (i = 0; i < step_count; i++) {
+		/* last step indicator */
+		if (steps[i].periph == NULL)
+			break;
 
-	sBUG_ON(periph == NULL);
+		/* see indigo_gpio_perform_sequence() on where aborts stop it */
+		if (steps[i].function == INDIGO_FUNCTION_STATUS &&
+			indigo_peripheral_abort_reason(steps[i].periph) != 0) {
+			result = indigo_peripheral_abort_reason(steps[i].periph);
+			break;
+		}
 
-	if (!periph->status(periph))
-		result = periph->power_on(periph);
+		start = ktime_get();
+		indigo_gpio_step_output(&steps[i]);
+
+		if (indigo_gpio_step_hold_ms(&steps[i]) != 0)
+			indigo_gpio_step_sleep(&steps[i], start);
+
+		indigo_gpio_trace_step(&steps[i], start);
+
+		result = indigo_gpio_step_wait_status(&steps[i], result);
+	}
 
-	TRACE_EXIT_RES(result);
 	return result;
 }
 
 /*
- * ------------------------------------------------------
- * ------------------------------------------------------
- */
-
-/*
- *     SimCOM Sim508 GSM Module
- *
- * Sim508 Hardware Definition 2.08
+ * hrtimer engine: every step gets an absolute CLOCK_MONOTONIC deadline,
+ * deadline of step N+1 is deadline of step N plus its hold time, so
+ * timer latency never accumulates along the sequence.
  *
- * FIXME error reporting
+ * Output steps are executed right from the timer callback, i.e. in hard
+ * IRQ context: pins are looked up and checked beforehand, the callback
+ * only sets them and stamps the time, tracing is done by the thread.
+ * The calling thread only wakes up for status waits and when the
+ * sequence is over.
  */
+#define INDIGO_SEQUENCE_MAX_STEPS 16
 
+/* what the callback needs of a step, resolved before the sequence starts */
+struct indigo_gpio_step_slot {
+	int pin; /* INDIGO_NO_PIN unless it's an output step */
+	int level; /* on the wire */
+	ktime_t started; /* when the output was set */
+};
 
-/* p.3.4.1.1, figure 3 */
-int gsm_sim508_power_on(struct gpio_peripheral *periph)
+struct indigo_gpio_sequence_run {
+	struct hrtimer timer;
+	struct indigo_gpio_sequence_step *steps;
+	struct indigo_gpio_step_slot slots[INDIGO_SEQUENCE_MAX_STEPS];
+	int step_count;
+	int current_step; /* first step not executed yet */
+	ktime_t deadline; /* when current_step is due */
+	ktime_t segment_end; /* when the callback stopped */
+	struct completion segment_done;
+};
+
+/* context: thread, may panic like indigo_gpioperiph_set_output() does */
+static void indigo_gpio_resolve_steps(struct indigo_gpio_sequence_run *run)
 {
-	int status = 0;
-	int result = 0;
+	struct indigo_gpio_sequence_step *step;
+	struct indigo_gpio_step_slot *slot;
+	int i;
 
-	struct indigo_gpio_sequence_step steps[] = {
-		{"0", "turn on POWER pin if available",
-		 periph, INDIGO_FUNCTION_POWER, 1, false, 0, 0},
+	for (i = 0; i < run->step_count; i++) {
+		step = &run->steps[i];
+		slot = &run->slots[i];
+		slot->pin = INDIGO_NO_PIN;
 
-		{"1", "pwrkey to 1 for 0.5s -- nonstrict, ends at t0",
-		 periph, INDIGO_FUNCTION_PWRKEY, 1, true, 500, 0},
+		if (step->periph == NULL)
+			break;
 
-		{"2", "pwrkey to 0 for t - t0 > 2s -- strict",
-		 periph, INDIGO_FUNCTION_PWRKEY, 0, true, 2100, 0},
+		if (step->function == INDIGO_FUNCTION_NO_FUNCTION ||
+			step->function == INDIGO_FUNCTION_STATUS)
+			continue;
 
-		{"3", "pwrkey to 1",
-		 periph, INDIGO_FUNCTION_PWRKEY, 1, true, 0, 0},
+		slot->pin = indigo_gpioperiph_get_mandatory_pin_by_function(step->periph,
+							step->function, step->mandatory);
+		if (slot->pin == INDIGO_NO_PIN)
+			continue;
 
-		/* monitor status pin for value 1 */
-		{"4", "wait for status pin to come up",
-		 periph, INDIGO_FUNCTION_STATUS, 1, true, 0, 12000},
+		if ((step->periph->pins[slot->pin].flags & GPIOF_DIR_IN) != 0) {
+			printk(KERN_ERR "tried to output to input pin %d\n", slot->pin);
+			sBUG();
+			slot->pin = INDIGO_NO_PIN;
+			continue;
+		}
 
-		{"5", "finally, status pin is 1 when all is ok",
-		 NULL, INDIGO_FUNCTION_NO_FUNCTION, 0, true, 0, 0}
-	};
+		slot->level = indigo_pin_active_value(&step->periph->pins[slot->pin],
+						step->value);
+	}
+}
 
-	TRACE_ENTRY();
+/* context: hard IRQ */
+static enum hrtimer_restart indigo_gpio_sequence_timer(struct hrtimer *timer)
+{
+	struct indigo_gpio_sequence_run *run;
+	struct indigo_gpio_sequence_step *step;
+	struct indigo_gpio_step_slot *slot;
 
-	sBUG_ON(periph == NULL);
-	sBUG_ON(periph->status == NULL);
+	run = container_of(timer, struct indigo_gpio_sequence_run, timer);
 
-	/* initially, status pin is 0 -- modem is turned off */
-	if (periph->status(periph)) {
-		printk(KERN_ERR "tried to power on device with status pin 1");
-		result = -ENODEV;
-		goto out;
-	}
+	while (run->current_step < run->step_count) {
+		step = &run->steps[run->current_step];
+		slot = &run->slots[run->current_step];
 
-	indigo_gpio_perform_sequence(&steps[0], ARRAY_SIZE(steps));
+		/* last step indicator and status waits go back to the thread */
+		if (step->periph == NULL || step->function == INDIGO_FUNCTION_STATUS)
+			break;
 
-	status = periph->status(periph);
+		slot->started = ktime_get();
+		if (slot->pin != INDIGO_NO_PIN)
+			indigo_gpioperiph_write_pin(step->periph, slot->pin, slot->level);
+		run->current_step++;
 
-	PRINT(KERN_ERR, "status pin is %d", status);
+		if (indigo_gpio_step_hold_ms(step) != 0) {
+			run->deadline = indigo_ktime_add_ms(run->deadline,
+							indigo_gpio_step_hold_ms(step));
+			hrtimer_set_expires(timer, run->deadline);
+			return HRTIMER_RESTART;
+		}
+	}
 
-	result = !status;
-out:
-	TRACE_EXIT_RES(result);
-	return result; /* 0 is OK code, 1 -- error */
+	run->segment_end = ktime_get();
+	complete(&run->segment_done);
+	return HRTIMER_NORESTART;
 }
 
-/* p.3.4.2.1. figure 4 */
-int gsm_sim508_power_off(struct gpio_peripheral *periph)
+/* trace output steps [@first, current_step) the callback has executed */
+static void indigo_gpio_trace_segment(struct indigo_gpio_sequence_run *run, int first)
 {
-	int status;
+	ktime_t end;
+	int i;
+
+	for (i = first; i < run->current_step; i++) {
+		end = i + 1 < run->current_step ? run->slots[i + 1].started : run->segment_end;
+		indigo_gpio_trace_step_at(&run->steps[i], run->slots[i].started, end);
+	}
+}
+
+static int indigo_gpio_perform_sequence_hrtimer(struct indigo_gpio_sequence_step *steps,
+					int step_count)
+{
+	struct indigo_gpio_sequence_run run;
+	struct indigo_gpio_sequence_step *step;
+	ktime_t expires;
+	int first;
 	int result = 0;
 
-	struct indigo_gpio_sequence_step steps[] = {
+	run.steps = steps;
+	run.step_count = step_count;
+	run.current_step = 0;
+	indigo_gpio_resolve_steps(&run);
 
-		{"1", "pwrkey -> 1 for 500ms",
-		 periph, INDIGO_FUNCTION_PWRKEY, 1, true, 500, 0},
+	init_completion(&run.segment_done);
+	hrtimer_init_on_stack(&run.timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	run.timer.function = indigo_gpio_sequence_timer;
+	run.deadline = ktime_get();
 
-		{"2", "pwrkey -> 0 for 2s < t < 1s",
-		 periph, INDIGO_FUNCTION_PWRKEY, 0, true, 1500, 0},
+	while (run.current_step < step_count) {
+		first = run.current_step;
+		INIT_COMPLETION(run.segment_done);
+		hrtimer_start(&run.timer, run.deadline, HRTIMER_MODE_ABS);
+		wait_for_completion(&run.segment_done);
 
-		{"3", "pwrkey to 1",
-		 periph, INDIGO_FUNCTION_PWRKEY, 1, true, 0, 0},
+		indigo_gpio_trace_segment(&run, first);
 
-		/* monitor status pin for value 1 */
-		{"4", "wait for 2 to 8 seconds for status pin to come down",
-		 periph, INDIGO_FUNCTION_STATUS, 1, true, 0, 10000},
+		if (run.current_step >= step_count)
+			break;
 
-		{"5", "finally, status pin is 0 when all is ok",
-		 NULL, INDIGO_FUNCTION_NO_FUNCTION, 0, true, 0, 0}
-	};
+		step = &steps[run.current_step];
 
-	TRACE_ENTRY();
+		/* last step indicator */
+		if (step->periph == NULL)
+			break;
 
-	sBUG_ON(periph == NULL);
-	sBUG_ON(periph->status == NULL);
+		if (indigo_peripheral_abort_reason(step->periph) != 0) {
+			result = indigo_peripheral_abort_reason(step->periph);
+			break;
+		}
 
-	/* initially, status pin is 1 -- modem is turned on */
-	if (!periph->status(periph)) {
-		printk(KERN_ERR "tried to power off device with status pin 0");
-		result = -ENODEV;
-		goto out;
-	}
+		/* status step: sleep_ms is still counted from its deadline */
+		if (step->sleep_ms != 0) {
+			expires = indigo_ktime_add_ms(run.deadline, step->sleep_ms);
+			set_current_state(TASK_UNINTERRUPTIBLE);
+			schedule_hrtimeout(&expires, HRTIMER_MODE_ABS);
+		}
+		indigo_gpio_trace_step(step, run.deadline);
 
-	indigo_gpio_perform_sequence(&steps[0], ARRAY_SIZE(steps));
+		result = indigo_gpio_step_wait_status(step, result);
 
-	status = periph->status(periph);
+		/* status came at its own pace, next steps are timed from now */
+		run.current_step++;
+		run.deadline = ktime_get();
+	}
 
-	PRINT(KERN_ERR, "status pin is %d", status);
+	/* callback may still be on its way out after complete() */
+	hrtimer_cancel(&run.timer);
+	destroy_hrtimer_on_stack(&run.timer);
 
-	result = status;
-out:
-	TRACE_EXIT_RES(result);
-	return result; /* 0 is OK code, 1 -- is error */
+	return result;
 }
 
-int gsm_sim508_setup(struct gpio_peripheral *periph)
-{
-	int result = 0;
+/**
+ * @step_count == ARRAY_SIZE(steps)
+ *
+ * context: !in_atomic()
+ *
+ * @INDIGO_FUNCTION_STATUS as pin kind is handled by timeout
+ *
+ * A cancel or deadline stops the sequence at a status step only, output
+ * steps always run in full so no pulse (PWRKEY, RESET) is left asserted.
+ */
+static int indigo_gpio_perform_sequence(struct indigo_gpio_sequence_step *steps,
+					int step_count)
+{
+	int result;
 
-	TRACE_ENTRY();
+	/* longer sequences don't fit struct indigo_gpio_sequence_run */
+	if (use_hrtimer_engine && step_count <= INDIGO_SEQUENCE_MAX_STEPS)
+		result = indigo_gpio_perform_sequence_hrtimer(steps, step_count);
+	else
+		result = indigo_gpio_perform_sequence_msleep(steps, step_count);
 
-	periph->reset = indigo_generic_reset;
-	periph->power_on = gsm_sim508_power_on;
-	periph->power_off = gsm_sim508_power_off;
-	periph->status = gsm_generic_status;
-	periph->check_and_power_on = indigo_check_and_power_on;
+	return result;
+}
 
-	result = gsm_generic_simcom_setup(periph, keep_turned_on_handler_irq);
+/* general GSM routines */
 
-	indigo_peripheral_create_command(periph, INDIGO_COMMAND_CHECK_AND_POWER_ON);
+/**
+ * Returns status pin value w/o interpretation
+ */
+static int gsm_generic_status(struct gpio_peripheral *periph)
+{
+	int status_pin = indigo_gpioperiph_get_pin_by_function(periph,
+							INDIGO_FUNCTION_STATUS);
 
-	TRACE_EXIT_RES(result);
-	return result;
+	return indigo_pin_active_value(
+		&periph->pins[status_pin],
+		gpio_get_value(periph->pins[status_pin].pin_no));
 }
-EXPORT_SYMBOL(gsm_sim508_setup);
-/*
- * ------------------------------------------------------
- * ------------------------------------------------------
- */
 
+static int indigo_peripheral_queue_command(struct gpio_peripheral *peripheral,
+					enum indigo_gpioperiph_command_t command,
+					enum indigo_command_origin_t origin);
 
-/*
- *     SimCOM Sim900D GSM Module (Device 1.0)
- *
- * Sim900D Hardware Design v.1.04
- *
- */
 
-/* figure 9 */
-int gsm_sim900D_power_on(struct gpio_peripheral *periph)
+static irqreturn_t keep_turned_on_handler_irq(int irq, void *dev)
 {
-	int status = 0;
-	int result = 0;
+	struct gpio_peripheral *device = (struct gpio_peripheral *) dev;
+	struct gpio_peripheral_obj *obj;
 
-	struct indigo_gpio_sequence_step steps[] = {
+	(void)irq;
 
-		{"0", "turn on POWER pin if available",
-		 periph, INDIGO_FUNCTION_POWER, 1, false, 0, 0},
+	obj = container_of(device, struct gpio_peripheral_obj, peripheral);
 
-		{"1", "pwrkey to 1 for 0.5s -- nonstrict, ends at t0",
-		 periph, INDIGO_FUNCTION_PWRKEY, 1, true, 500, 0},
+	/* status is back, a check pending from the falling edge is moot */
+	if (device->status(device)) {
+		cancel_delayed_work(&obj->check_status_work);
+		return IRQ_HANDLED;
+	}
 
-		{"2", "pwrkey to 0 for t - t0 > 1s -- strict",
-		 periph, INDIGO_FUNCTION_PWRKEY, 0, true, 1100, 0},
+	/*
+	 * schedule a check of device status after the grace period, the
+	 * modem may be rebooting itself
+	 */
+	queue_delayed_work(indigo_wq, &obj->check_status_work,
+			msecs_to_jiffies(obj->keep_on_grace_ms));
 
-		{"3", "pwrkey to 1",
-		 periph, INDIGO_FUNCTION_PWRKEY, 1, true, 0, 0},
+	return IRQ_HANDLED;
+}
 
-		/* monitor status pin for value 1 */
-		{"4", "wait for status pin to come up for more than 3.2 seconds after t0",
-		 periph, INDIGO_FUNCTION_STATUS, 1, true, 0, 10000},
+/*
+ * Keep-on policy: status has been 0 for the grace period, restart the
+ * device unless it was restarted less than the current backoff ago or
+ * restart budget for the current window is spent. Backoff doubles with
+ * every restart up to keep_on_backoff_max_ms and starts over together
+ * with the budget when keep_on_window_s passes.
+ */
+static void indigo_check_status(struct work_struct *work)
+{
+	struct gpio_peripheral_obj *peripheral_obj = NULL;
+	struct gpio_peripheral *device = NULL;
+	unsigned long now = jiffies;
+	unsigned long window_end;
+	unsigned long next_restart;
 
-		{"5", "finally, status pin is 1 when all is ok",
-		 NULL, INDIGO_FUNCTION_NO_FUNCTION, 0, true, 0, 0}
-	};
+	peripheral_obj = container_of(work, struct gpio_peripheral_obj, check_status_work.work);
+	device = &peripheral_obj->peripheral;
 
-	TRACE_ENTRY();
+	if (device->status(device))
+		goto out;
 
-	sBUG_ON(periph == NULL);
-	sBUG_ON(periph->status == NULL);
+	/* keep-on could be switched off during grace period */
+	if ((device->flags & GPIO_PERIPH_FLAG_KEEP_ON) == 0)
+		goto out;
 
-	/* initially, status pin is 0 -- modem is turned off */
-	if (periph->status(periph)) {
-		printk(KERN_ERR "tried to power on device with status pin 1");
-		result = -ENODEV;
+	window_end = peripheral_obj->keep_on_window_start +
+		msecs_to_jiffies(peripheral_obj->keep_on_window_s * MSEC_PER_SEC);
+	if (time_after_eq(now, window_end)) {
+		peripheral_obj->keep_on_window_start = now;
+		peripheral_obj->keep_on_restarts = 0;
+		peripheral_obj->keep_on_backoff_cur_ms = 0;
+		window_end = now + msecs_to_jiffies(peripheral_obj->keep_on_window_s * MSEC_PER_SEC);
+	}
+
+	if (peripheral_obj->keep_on_restarts >= peripheral_obj->keep_on_budget) {
+		printk(KERN_ERR "%s: %u restarts in %u s, next try in %u ms\n",
+			device->name, peripheral_obj->keep_on_restarts,
+			peripheral_obj->keep_on_window_s,
+			jiffies_to_msecs(window_end - now));
+		queue_delayed_work(indigo_wq, &peripheral_obj->check_status_work,
+				window_end - now);
 		goto out;
 	}
 
-	indigo_gpio_perform_sequence(&steps[0], ARRAY_SIZE(steps));
+	next_restart = peripheral_obj->keep_on_last_restart +
+		msecs_to_jiffies(peripheral_obj->keep_on_backoff_cur_ms);
+	if (peripheral_obj->keep_on_backoff_cur_ms != 0 && time_before(now, next_restart)) {
+		queue_delayed_work(indigo_wq, &peripheral_obj->check_status_work,
+				next_restart - now);
+		goto out;
+	}
 
-	status = periph->status(periph);
-	PRINT(KERN_ERR, "status pin is %d", status);
+	peripheral_obj->keep_on_restarts++;
+	atomic_inc(&peripheral_obj->stats.keep_on_restarts);
+	peripheral_obj->keep_on_last_restart = now;
+	if (peripheral_obj->keep_on_backoff_cur_ms == 0)
+		peripheral_obj->keep_on_backoff_cur_ms = peripheral_obj->keep_on_backoff_ms;
+	else
+		peripheral_obj->keep_on_backoff_cur_ms =
+			min(peripheral_obj->keep_on_backoff_cur_ms * 2,
+				peripheral_obj->keep_on_backoff_max_ms);
 
-	result = !status;
+	indigo_peripheral_queue_command(device, INDIGO_COMMAND_CHECK_AND_POWER_ON,
+					INDIGO_ORIGIN_KEEP_ON);
 
 out:
-	TRACE_EXIT_RES(result);
-	return result; /* 0 is OK code, 1 -- error */
+	return;
 }
 
-/* figure 10 */
-int gsm_sim900D_power_off(struct gpio_peripheral *periph)
+/* account powered-on time on every status change we get to see */
+static void indigo_stats_power(struct gpio_peripheral_obj *obj, bool on)
 {
-	int status;
-	int result;
+	struct indigo_periph_stats *stats = &obj->stats;
+	unsigned long flags = 0;
+	ktime_t now = ktime_get();
+
+	spin_lock_irqsave(&obj->command_lock, flags);
+	if (stats->powered && !on)
+		stats->powered_ns += ktime_to_ns(ktime_sub(now, stats->powered_since));
+	else if (!stats->powered && on)
+		stats->powered_since = now;
+	stats->powered = on;
+	spin_unlock_irqrestore(&obj->command_lock, flags);
+}
 
-	struct indigo_gpio_sequence_step steps[] = {
-		{"1", "pwrkey -> 0 for 5s < t < 1s",
-		 periph, INDIGO_FUNCTION_PWRKEY, 0, true, 2000, 0},
+/*
+ * Status pin IRQ is requested once per peripheral. It wakes up status
+ * waits of running sequences and chains to keep-on handler if it's set.
+ */
+static irqreturn_t indigo_status_edge_hardirq(int irq, void *dev)
+{
+	struct gpio_peripheral *periph = (struct gpio_peripheral *) dev;
+	struct indigo_periph_pin *status_pin;
 
-		{"2", "set PWRKEY -> 1",
-		 periph, INDIGO_FUNCTION_PWRKEY, 1, true, 50, 0},
+	(void) irq;
 
-		/* monitor status pin for value 0 */
-		{"3", "wait for status pin to come down for more than 3.2 seconds after t0",
-		 periph, INDIGO_FUNCTION_STATUS, 0, true, 0, 10000},
+	status_pin = &periph->pins[periph->function_pins[INDIGO_FUNCTION_STATUS]];
+	status_pin->edge_time = ktime_get();
+	status_pin->edge_level = gpio_get_value(status_pin->pin_no);
+	indigo_waveform_record(status_pin, status_pin->edge_level);
+	indigo_events_push(status_pin);
 
-		{"4", "finally, status pin is 0 when all is ok",
-		 NULL, INDIGO_FUNCTION_NO_FUNCTION, 0, true, 0, 0}
-	};
+	indigo_state_set_pin(container_of(periph, struct gpio_peripheral_obj, peripheral),
+			status_pin - periph->pins, status_pin->edge_level);
 
-	TRACE_ENTRY();
+	/* until the thread re-reads it */
+	indigo_status_invalidate(container_of(periph, struct gpio_peripheral_obj, peripheral));
 
-	/* same as sim900 */
+	return IRQ_WAKE_THREAD;
+}
 
-	sBUG_ON(periph == NULL);
-	sBUG_ON(periph->status == NULL);
+/* context: IRQ thread */
+static irqreturn_t indigo_status_irq_handler(int irq, void *dev)
+{
+	struct gpio_peripheral *periph = (struct gpio_peripheral *) dev;
+	struct gpio_peripheral_obj *obj;
+	const struct indigo_periph_pin *status_pin;
+	irq_handler_t keep_on_handler;
+	int status;
 
-	/* initially, status pin is 1 -- modem is turned on */
-	if (!periph->status(periph)) {
-		printk(KERN_ERR "tried to power off device with status pin 0");
-		result = -ENODEV;
-		goto out;
-	}
+	obj = container_of(periph, struct gpio_peripheral_obj, peripheral);
 
-	indigo_gpio_perform_sequence(&steps[0], ARRAY_SIZE(steps));
+	status_pin = &periph->pins[periph->function_pins[INDIGO_FUNCTION_STATUS]];
+	trace_indigo_pin_irq(status_pin);
 
 	status = periph->status(periph);
+	indigo_status_set(obj, status);
+	indigo_stats_power(obj, status);
 
-	PRINT(KERN_ERR, "status pin is %d", status);
+	wake_up_all(&obj->status_wait);
 
-	result = status;
-out:
-	TRACE_EXIT_RES(result);
-	return result; /* 0 is OK code, 1 -- is error */
+	keep_on_handler = ACCESS_ONCE(obj->keep_on_handler);
+	if (keep_on_handler != NULL)
+		return keep_on_handler(irq, dev);
+
+	return IRQ_HANDLED;
 }
 
-int gsm_sim900D_setup(struct gpio_peripheral *periph)
+/* without the irq status waits fall back to polling */
+static int indigo_request_status_irq(struct gpio_peripheral *periph)
 {
+	struct gpio_peripheral_obj *obj;
+	int status;
 	int result = 0;
 
 	TRACE_ENTRY();
 
 	sBUG_ON(periph == NULL);
 
-	periph->status = gsm_generic_status;
-	periph->power_on = gsm_sim900D_power_on;
-	periph->power_off = gsm_sim900D_power_off;
-	periph->reset = indigo_generic_reset;
-	periph->check_and_power_on = indigo_check_and_power_on;
+	obj = container_of(periph, struct gpio_peripheral_obj, peripheral);
+	if (obj->status_irq)
+		goto out;
 
-	result = gsm_generic_simcom_setup(periph, keep_turned_on_handler_irq);
+	status = indigo_gpioperiph_get_pin_by_function(periph, INDIGO_FUNCTION_STATUS);
+	if (status == INDIGO_NO_PIN) {
+		result = -ENOENT;
+		goto out;
+	}
 
-	indigo_peripheral_create_command(periph, INDIGO_COMMAND_CHECK_AND_POWER_ON);
+	result = request_threaded_irq(gpio_to_irq(periph->pins[status].pin_no),
+				indigo_status_edge_hardirq,
+				indigo_status_irq_handler,
+				IRQF_TRIGGER_FALLING | IRQF_TRIGGER_RISING | IRQF_ONESHOT,
+				periph->pins[status].description, (void *) periph);
+	if (result) {
+		printk(KERN_ERR "can not request irq for status pin, result %d\n", result);
+		goto out;
+	}
 
+	obj->status_irq = true;
+	indigo_state_set_pin(obj, status, gpio_get_value(periph->pins[status].pin_no));
+out:
 	TRACE_EXIT_RES(result);
 	return result;
 }
-EXPORT_SYMBOL(gsm_sim900D_setup);
-
-/*
- * ------------------------------------------------------
- * ------------------------------------------------------
- */
 
-/*
- * SimCOM Sim900 GSM Module (Device 1.1 and after)
- *
- * @dev -- struct gpio_peripheral, describing the modem
- *
- * All operations are as per Sim900D Hardware Design v...
- */
-/* figure 9, pg 25 */
-int gsm_sim900_power_on(struct gpio_peripheral *periph)
+/* шлём либо NULL, либо keen_turned_on_handler_irq */
+static int indigo_set_keep_on_handler(struct gpio_peripheral *periph,
+				irq_handler_t status_pin_handler)
 {
-	int status = 0;
-	int result;
-
-	struct indigo_gpio_sequence_step steps[] = {
-
-		{"0", "turn on POWER pin if available",
-		 periph, INDIGO_FUNCTION_POWER, 1, false, 0, 0},
-
-		{"1", "pwrkey to 1 for 0.5s -- nonstrict, ends at t0",
-		 periph, INDIGO_FUNCTION_PWRKEY, 1, true, 500, 0},
-
-		{"2", "pwrkey to 0 for t - t0 > 1s -- strict",
-		 periph, INDIGO_FUNCTION_PWRKEY, 0, true, 1100, 0},
-
-		{"3", "pwrkey to 1",
-		 periph, INDIGO_FUNCTION_PWRKEY, 1, true, 0, 0},
-
-		/* monitor status pin for value 1 */
-		{"4", "wait for status pin to come up for more than t - t0 > 2.2 s",
-		 periph, INDIGO_FUNCTION_STATUS, 1, true, 0, 10000},
-
-		{"5", "finally, status pin is 1 when all is ok",
-		 NULL, INDIGO_FUNCTION_NO_FUNCTION, 0, true, 0, 0}
-	};
-
+	struct gpio_peripheral_obj *obj;
+	int result = 0;
 
 	TRACE_ENTRY();
 
 	sBUG_ON(periph == NULL);
-	sBUG_ON(periph->status == NULL);
 
-	/* initially, status pin is 0 -- modem is turned off */
-	if (periph->status(periph)) {
-		printk(KERN_ERR "tried to power on device with status pin 1");
-		result = -ENODEV;
-		goto out;
-	}
+	obj = container_of(periph, struct gpio_peripheral_obj, peripheral);
 
-	indigo_gpio_perform_sequence(&steps[0], ARRAY_SIZE(steps));
+	if ((status_pin_handler != NULL) && (periph->flags & GPIO_PERIPH_FLAG_KEEP_ON) == 0) {
+		result = indigo_request_status_irq(periph);
+		if (result == -ENOENT)
+			goto out;
 
-	status = periph->status(periph);
-	PRINT(KERN_ERR, "device status is %d", status);
+		if (result) {
+			printk(KERN_ERR "can not request irq for status pin\n");
+			panic("can not request irq for status pin\n");
+		}
 
-	result = !status;
+		obj->keep_on_handler = status_pin_handler;
+		periph->flags |= GPIO_PERIPH_FLAG_KEEP_ON;
+	} else if (status_pin_handler == NULL && (periph->flags & GPIO_PERIPH_FLAG_KEEP_ON) != 0) {
+		/* irq itself stays, status waits need it */
+		obj->keep_on_handler = NULL;
+		periph->flags &= ~GPIO_PERIPH_FLAG_KEEP_ON;
+	}
+
+	indigo_state_set_flags(obj);
 out:
 	TRACE_EXIT_RES(result);
-	return result; /* 0 is OK code, 1 -- error */
+	return result;
 }
 
-int gsm_sim900_power_off(struct gpio_peripheral *periph)
+/**
+ * Configure status pin for given interrupt handler, a pwrkey pin
+ * and power pin if one's available
+ *
+ * All supported modems have at least two functional pins --
+ * pwr_key and status pin. Our schematics has a power pin to
+ * physically turn off the device.
+ */
+static int gsm_generic_simcom_setup(struct gpio_peripheral *periph,
+				irq_handler_t status_pin_handler)
 {
+	int result = 0;
 	int status;
-	int result;
-
-	struct indigo_gpio_sequence_step steps[] = {
-
-		{"1", "pwrkey -> 0 for 5s < t < 1s",
-		 periph, INDIGO_FUNCTION_PWRKEY, 0, true, 2000, 0},
-
-		{"2", "set PWRKEY -> 1",
-		 periph, INDIGO_FUNCTION_PWRKEY, 1, true, 50, 0},
-
-		/* monitor status pin for value 0 */
-		{"3", "wait for > 1.7 seconds",
-		 periph, INDIGO_FUNCTION_STATUS, 0, true, 0, 10000},
 
-		{"4", "turn off gsm enable pin",
-		 periph, INDIGO_FUNCTION_POWER, 0, true, 1, 0},
+	TRACE_ENTRY();
 
-		{"5", "finally, status pin is 0 when all is ok",
-		 NULL, INDIGO_FUNCTION_NO_FUNCTION, 0, true, 0, 0}
-	};
+	/* we will not return from there if configuration has failed */
 
-	TRACE_ENTRY();
+	status = indigo_configure_pin(periph, INDIGO_FUNCTION_STATUS, /* mandatory */ true);
 
-	/* same as sim900 */
+	periph->status = gsm_generic_status;
 
-	sBUG_ON(periph == NULL);
+	indigo_request_status_irq(periph);
 
-	/* initially, status pin is 1 -- modem is turned on */
-	if (!periph->status(periph)) {
-		printk(KERN_ERR "tried to power off device with status pin 0");
-		result = -ENODEV;
-		goto out;
-	}
+	if (status_pin_handler != NULL)
+		indigo_set_keep_on_handler(periph, status_pin_handler);
 
-	indigo_gpio_perform_sequence(&steps[0], ARRAY_SIZE(steps));
+	indigo_configure_pin(periph, INDIGO_FUNCTION_PWRKEY, /* mandatory */ true);
 
-	status = periph->status(periph);
-	PRINT(KERN_ERR, "device status is %d", status);
+	/* it doesn't really matter if it's not found */
+	indigo_configure_pin(periph, INDIGO_FUNCTION_POWER, /* mandatory */ false);
 
-	result = status;
-out:
 	TRACE_EXIT_RES(result);
-	return result; /* 0 is OK code, 1 -- is error */
-
+	return result;
 }
 
-int gsm_sim900_setup(struct gpio_peripheral *periph)
+/* FIXME error handling through int result */
+static int indigo_generic_reset(struct gpio_peripheral *periph)
 {
-
 	int result = 0;
 
 	TRACE_ENTRY();
 
-	periph->reset = indigo_generic_reset;
-	periph->status = gsm_generic_status;
-	periph->power_on = gsm_sim900_power_on;
-	periph->power_off = gsm_sim900_power_off;
-	periph->check_and_power_on = indigo_check_and_power_on;
-	periph->flags = 0;
+	sBUG_ON(periph == NULL);
 
-	result = gsm_generic_simcom_setup(periph, NULL);
+	TRACE_STEP("1", "restart");
+	if (periph->status(periph)) {
+		/* option 1. restart */
+		TRACE_STEP("1.1", "Power off");
+
+		result = periph->power_off(periph);
+
+		if (result) {
+			PRINT(KERN_ERR, "couldn't power off the device");
+			goto out;
+		}
+	}
+
+	TRACE_STEP("1.2", "Power on");
+	result = periph->power_on(periph);
 	if (result) {
-		PRINT(KERN_ERR, "error in generic_simcom_setup");
+		PRINT(KERN_ERR, "couldn't power on the device");
 		goto out;
 	}
 
-	indigo_peripheral_create_command(periph, INDIGO_COMMAND_POWER_ON);
+out:
+	TRACE_EXIT_RES(result);
+	return result;
+}
 
-	/* flag GPIO_PERIPH_KEEP_ON is set there */
-	indigo_set_keep_on_handler(periph, keep_turned_on_handler_irq);
+int indigo_gpio_do_nothing(struct gpio_peripheral *periph)
+{
+	TRACE_ENTRY();
+
+	(void) periph;
+
+	TRACE_EXIT_RES(0);
+	return 0;
+}
+
+/* заглушка для всяких BQ */
+int indigo_do_nothing_setup(struct gpio_peripheral *periph)
+{
+	TRACE_ENTRY();
+
+	periph->reset = indigo_gpio_do_nothing;
+	periph->power_on = indigo_gpio_do_nothing;
+	periph->power_off = indigo_gpio_do_nothing;
+	periph->check_and_power_on = indigo_gpio_do_nothing;
+	periph->status = indigo_gpio_do_nothing;
+
+	TRACE_EXIT_RES(0);
+	return 0;
+}
+EXPORT_SYMBOL(indigo_do_nothing_setup);
+
+static int indigo_check_and_power_on(struct gpio_peripheral *periph)
+{
+	int result = 0;
+
+	TRACE_ENTRY();
+
+	sBUG_ON(periph == NULL);
+
+	if (!periph->status(periph))
+		result = periph->power_on(periph);
 
-out:
 	TRACE_EXIT_RES(result);
 	return result;
 }
-EXPORT_SYMBOL(gsm_sim900_setup);
 
 /*
  * ------------------------------------------------------
@@ -968,38 +1736,174 @@ EXPORT_SYMBOL(gsm_sim900_setup);
  */
 
 /*
- * SimCOM Sim508 GPS Module (Starterkit devices)
+ *     SimCOM Sim508 GSM Module
  *
- * Manual used is Sim508 Hardware Design 2.08
+ * Sim508 Hardware Definition 2.08
+ *
+ * FIXME error reporting
  */
-static int gps_sim508_status(struct gpio_peripheral *periph)
+
+
+/* p.3.4.1.1, figure 3 */
+int gsm_sim508_power_on(struct gpio_peripheral *periph)
 {
-	int power_pin;
+	int status = 0;
 	int result = 0;
 
+	struct indigo_gpio_sequence_step steps[] = {
+		INDIGO_STEP("0", "turn on POWER pin if available",
+			periph, INDIGO_FUNCTION_POWER, 1, false, 0, 0),
+
+		INDIGO_STEP("1", "pwrkey to 1 for 0.5s -- nonstrict, ends at t0",
+			periph, INDIGO_FUNCTION_PWRKEY, 1, true, 500, 0),
+
+		INDIGO_STEP_WINDOW("2", "pwrkey to 0 for t - t0 > 2s -- strict",
+			periph, INDIGO_FUNCTION_PWRKEY, 0, true, 2100, 0, 2000, 0),
+
+		INDIGO_STEP("3", "pwrkey to 1",
+			periph, INDIGO_FUNCTION_PWRKEY, 1, true, 0, 0),
+
+		/* monitor status pin for value 1 */
+		INDIGO_STEP("4", "wait for status pin to come up",
+			periph, INDIGO_FUNCTION_STATUS, 1, true, 0, 12000),
+
+		INDIGO_STEP("5", "finally, status pin is 1 when all is ok",
+			NULL, INDIGO_FUNCTION_NO_FUNCTION, 0, true, 0, 0)
+	};
+
 	TRACE_ENTRY();
 
 	sBUG_ON(periph == NULL);
+	sBUG_ON(periph->status == NULL);
 
-	power_pin = indigo_gpioperiph_get_pin_by_function(periph, INDIGO_FUNCTION_POWER);
+	/* initially, status pin is 0 -- modem is turned off */
+	if (periph->status(periph)) {
+		printk(KERN_ERR "tried to power on device with status pin 1");
+		result = -ENODEV;
+		goto out;
+	}
 
-	result = indigo_pin_active_value(&periph->pins[power_pin],
-					gpio_get_value(periph->pins[power_pin].pin_no));
+	indigo_gpio_perform_sequence(&steps[0], ARRAY_SIZE(steps));
+
+	status = periph->status(periph);
 
+	PRINT(KERN_ERR, "status pin is %d", status);
+
+	result = !status;
+out:
 	TRACE_EXIT_RES(result);
-	return result;
+	return result; /* 0 is OK code, 1 -- error */
 }
 
-/* figure 28 */
-int gps_sim508_power_on(struct gpio_peripheral *periph)
+/* p.3.4.2.1. figure 4 */
+int gsm_sim508_power_off(struct gpio_peripheral *periph)
 {
 	int status;
-	int result;
+	int result = 0;
+
+	struct indigo_gpio_sequence_step steps[] = {
+
+		INDIGO_STEP("1", "pwrkey -> 1 for 500ms",
+			periph, INDIGO_FUNCTION_PWRKEY, 1, true, 500, 0),
+
+		INDIGO_STEP_WINDOW("2", "pwrkey -> 0 for 2s < t < 1s",
+			periph, INDIGO_FUNCTION_PWRKEY, 0, true, 1500, 0, 1000, 2000),
+
+		INDIGO_STEP("3", "pwrkey to 1",
+			periph, INDIGO_FUNCTION_PWRKEY, 1, true, 0, 0),
+
+		/* monitor status pin for value 1 */
+		INDIGO_STEP("4", "wait for 2 to 8 seconds for status pin to come down",
+			periph, INDIGO_FUNCTION_STATUS, 1, true, 0, 10000),
+
+		INDIGO_STEP("5", "finally, status pin is 0 when all is ok",
+			NULL, INDIGO_FUNCTION_NO_FUNCTION, 0, true, 0, 0)
+	};
+
+	TRACE_ENTRY();
+
+	sBUG_ON(periph == NULL);
+	sBUG_ON(periph->status == NULL);
+
+	/* initially, status pin is 1 -- modem is turned on */
+	if (!periph->status(periph)) {
+		printk(KERN_ERR "tried to power off device with status pin 0");
+		result = -ENODEV;
+		goto out;
+	}
+
+	indigo_gpio_perform_sequence(&steps[0], ARRAY_SIZE(steps));
+
+	status = periph->status(periph);
+
+	PRINT(KERN_ERR, "status pin is %d", status);
+
+	result = status;
+out:
+	TRACE_EXIT_RES(result);
+	return result; /* 0 is OK code, 1 -- is error */
+}
+
+int gsm_sim508_setup(struct gpio_peripheral *periph)
+{
+	int result = 0;
+
+	TRACE_ENTRY();
+
+	periph->reset = indigo_generic_reset;
+	periph->power_on = gsm_sim508_power_on;
+	periph->power_off = gsm_sim508_power_off;
+	periph->status = gsm_generic_status;
+	periph->check_and_power_on = indigo_check_and_power_on;
+
+	result = gsm_generic_simcom_setup(periph, keep_turned_on_handler_irq);
+
+	indigo_peripheral_queue_command(periph, INDIGO_COMMAND_CHECK_AND_POWER_ON,
+					INDIGO_ORIGIN_BOOT);
+
+	TRACE_EXIT_RES(result);
+	return result;
+}
+EXPORT_SYMBOL(gsm_sim508_setup);
+/*
+ * ------------------------------------------------------
+ * ------------------------------------------------------
+ */
+
+
+/*
+ *     SimCOM Sim900D GSM Module (Device 1.0)
+ *
+ * Sim900D Hardware Design v.1.04
+ *
+ */
+
+/* figure 9 */
+int gsm_sim900D_power_on(struct gpio_peripheral *periph)
+{
+	int status = 0;
+	int result = 0;
 
 	struct indigo_gpio_sequence_step steps[] = {
-		{"1", "set power to on and wait 220 ms",
-		 periph, INDIGO_FUNCTION_POWER, 1, true, 220, 0},
 
+		INDIGO_STEP("0", "turn on POWER pin if available",
+			periph, INDIGO_FUNCTION_POWER, 1, false, 0, 0),
+
+		INDIGO_STEP("1", "pwrkey to 1 for 0.5s -- nonstrict, ends at t0",
+			periph, INDIGO_FUNCTION_PWRKEY, 1, true, 500, 0),
+
+		INDIGO_STEP_WINDOW("2", "pwrkey to 0 for t - t0 > 1s -- strict",
+			periph, INDIGO_FUNCTION_PWRKEY, 0, true, 1100, 0, 1000, 0),
+
+		INDIGO_STEP("3", "pwrkey to 1",
+			periph, INDIGO_FUNCTION_PWRKEY, 1, true, 0, 0),
+
+		/* monitor status pin for value 1 */
+		INDIGO_STEP("4", "wait for status pin to come up for more than 3.2 seconds after t0",
+			periph, INDIGO_FUNCTION_STATUS, 1, true, 0, 10000),
+
+		INDIGO_STEP("5", "finally, status pin is 1 when all is ok",
+			NULL, INDIGO_FUNCTION_NO_FUNCTION, 0, true, 0, 0)
 	};
 
 	TRACE_ENTRY();
@@ -1007,8 +1911,9 @@ int gps_sim508_power_on(struct gpio_peripheral *periph)
 	sBUG_ON(periph == NULL);
 	sBUG_ON(periph->status == NULL);
 
+	/* initially, status pin is 0 -- modem is turned off */
 	if (periph->status(periph)) {
-		printk(KERN_ERR "GPS already seems to work\n");
+		printk(KERN_ERR "tried to power on device with status pin 1");
 		result = -ENODEV;
 		goto out;
 	}
@@ -1016,443 +1921,1402 @@ int gps_sim508_power_on(struct gpio_peripheral *periph)
 	indigo_gpio_perform_sequence(&steps[0], ARRAY_SIZE(steps));
 
 	status = periph->status(periph);
-	PRINT(KERN_ERR, "device status is %d", status);
+	PRINT(KERN_ERR, "status pin is %d", status);
 
 	result = !status;
+
 out:
 	TRACE_EXIT_RES(result);
-	return result;
+	return result; /* 0 is OK code, 1 -- error */
 }
 
-/* no precise way to nicely turn this off */
-int gps_sim508_power_off(struct gpio_peripheral *periph)
+/* figure 10 */
+int gsm_sim900D_power_off(struct gpio_peripheral *periph)
 {
+	int status;
+	int result;
+
 	struct indigo_gpio_sequence_step steps[] = {
-		{"1", "set power to off and wait some time (500 ms)",
-		 periph, INDIGO_FUNCTION_POWER, 0, true, 500, 0},
+		INDIGO_STEP_WINDOW("1", "pwrkey -> 0 for 5s < t < 1s",
+			periph, INDIGO_FUNCTION_PWRKEY, 0, true, 2000, 0, 1000, 5000),
 
+		INDIGO_STEP("2", "set PWRKEY -> 1",
+			periph, INDIGO_FUNCTION_PWRKEY, 1, true, 50, 0),
+
+		/* monitor status pin for value 0 */
+		INDIGO_STEP("3", "wait for status pin to come down for more than 3.2 seconds after t0",
+			periph, INDIGO_FUNCTION_STATUS, 0, true, 0, 10000),
+
+		INDIGO_STEP("4", "finally, status pin is 0 when all is ok",
+			NULL, INDIGO_FUNCTION_NO_FUNCTION, 0, true, 0, 0)
 	};
 
 	TRACE_ENTRY();
 
+	/* same as sim900 */
+
 	sBUG_ON(periph == NULL);
 	sBUG_ON(periph->status == NULL);
 
+	/* initially, status pin is 1 -- modem is turned on */
 	if (!periph->status(periph)) {
-		printk(KERN_ERR "GPS already seems to be turned off\n");
-		sBUG();
-		return -ENODEV;
+		printk(KERN_ERR "tried to power off device with status pin 0");
+		result = -ENODEV;
+		goto out;
+	}
+
+	indigo_gpio_perform_sequence(&steps[0], ARRAY_SIZE(steps));
+
+	status = periph->status(periph);
+
+	PRINT(KERN_ERR, "status pin is %d", status);
+
+	result = status;
+out:
+	TRACE_EXIT_RES(result);
+	return result; /* 0 is OK code, 1 -- is error */
+}
+
+int gsm_sim900D_setup(struct gpio_peripheral *periph)
+{
+	int result = 0;
+
+	TRACE_ENTRY();
+
+	sBUG_ON(periph == NULL);
+
+	periph->status = gsm_generic_status;
+	periph->power_on = gsm_sim900D_power_on;
+	periph->power_off = gsm_sim900D_power_off;
+	periph->reset = indigo_generic_reset;
+	periph->check_and_power_on = indigo_check_and_power_on;
+
+	result = gsm_generic_simcom_setup(periph, keep_turned_on_handler_irq);
+
+	indigo_peripheral_queue_command(periph, INDIGO_COMMAND_CHECK_AND_POWER_ON,
+					INDIGO_ORIGIN_BOOT);
+
+	TRACE_EXIT_RES(result);
+	return result;
+}
+EXPORT_SYMBOL(gsm_sim900D_setup);
+
+/*
+ * ------------------------------------------------------
+ * ------------------------------------------------------
+ */
+
+/*
+ * SimCOM Sim900 GSM Module (Device 1.1 and after)
+ *
+ * @dev -- struct gpio_peripheral, describing the modem
+ *
+ * All operations are as per Sim900D Hardware Design v...
+ */
+/* figure 9, pg 25 */
+int gsm_sim900_power_on(struct gpio_peripheral *periph)
+{
+	int status = 0;
+	int result;
+
+	struct indigo_gpio_sequence_step steps[] = {
+
+		INDIGO_STEP("0", "turn on POWER pin if available",
+			periph, INDIGO_FUNCTION_POWER, 1, false, 0, 0),
+
+		INDIGO_STEP("1", "pwrkey to 1 for 0.5s -- nonstrict, ends at t0",
+			periph, INDIGO_FUNCTION_PWRKEY, 1, true, 500, 0),
+
+		INDIGO_STEP_WINDOW("2", "pwrkey to 0 for t - t0 > 1s -- strict",
+			periph, INDIGO_FUNCTION_PWRKEY, 0, true, 1100, 0, 1000, 0),
+
+		INDIGO_STEP("3", "pwrkey to 1",
+			periph, INDIGO_FUNCTION_PWRKEY, 1, true, 0, 0),
+
+		/* monitor status pin for value 1 */
+		INDIGO_STEP("4", "wait for status pin to come up for more than t - t0 > 2.2 s",
+			periph, INDIGO_FUNCTION_STATUS, 1, true, 0, 10000),
+
+		INDIGO_STEP("5", "finally, status pin is 1 when all is ok",
+			NULL, INDIGO_FUNCTION_NO_FUNCTION, 0, true, 0, 0)
+	};
+
+
+	TRACE_ENTRY();
+
+	sBUG_ON(periph == NULL);
+	sBUG_ON(periph->status == NULL);
+
+	/* initially, status pin is 0 -- modem is turned off */
+	if (periph->status(periph)) {
+		printk(KERN_ERR "tried to power on device with status pin 1");
+		result = -ENODEV;
+		goto out;
+	}
+
+	indigo_gpio_perform_sequence(&steps[0], ARRAY_SIZE(steps));
+
+	status = periph->status(periph);
+	PRINT(KERN_ERR, "device status is %d", status);
+
+	result = !status;
+out:
+	TRACE_EXIT_RES(result);
+	return result; /* 0 is OK code, 1 -- error */
+}
+
+int gsm_sim900_power_off(struct gpio_peripheral *periph)
+{
+	int status;
+	int result;
+
+	struct indigo_gpio_sequence_step steps[] = {
+
+		INDIGO_STEP_WINDOW("1", "pwrkey -> 0 for 5s < t < 1s",
+			periph, INDIGO_FUNCTION_PWRKEY, 0, true, 2000, 0, 1000, 5000),
+
+		INDIGO_STEP("2", "set PWRKEY -> 1",
+			periph, INDIGO_FUNCTION_PWRKEY, 1, true, 50, 0),
+
+		/* monitor status pin for value 0 */
+		INDIGO_STEP_WINDOW("3", "wait for > 1.7 seconds",
+			periph, INDIGO_FUNCTION_STATUS, 0, true, 0, 10000, 1700, 0),
+
+		INDIGO_STEP("4", "turn off gsm enable pin",
+			periph, INDIGO_FUNCTION_POWER, 0, true, 1, 0),
+
+		INDIGO_STEP("5", "finally, status pin is 0 when all is ok",
+			NULL, INDIGO_FUNCTION_NO_FUNCTION, 0, true, 0, 0)
+	};
+
+	TRACE_ENTRY();
+
+	/* same as sim900 */
+
+	sBUG_ON(periph == NULL);
+
+	/* initially, status pin is 1 -- modem is turned on */
+	if (!periph->status(periph)) {
+		printk(KERN_ERR "tried to power off device with status pin 0");
+		result = -ENODEV;
+		goto out;
+	}
+
+	indigo_gpio_perform_sequence(&steps[0], ARRAY_SIZE(steps));
+
+	status = periph->status(periph);
+	PRINT(KERN_ERR, "device status is %d", status);
+
+	result = status;
+out:
+	TRACE_EXIT_RES(result);
+	return result; /* 0 is OK code, 1 -- is error */
+
+}
+
+int gsm_sim900_setup(struct gpio_peripheral *periph)
+{
+
+	int result = 0;
+
+	TRACE_ENTRY();
+
+	periph->reset = indigo_generic_reset;
+	periph->status = gsm_generic_status;
+	periph->power_on = gsm_sim900_power_on;
+	periph->power_off = gsm_sim900_power_off;
+	periph->check_and_power_on = indigo_check_and_power_on;
+	periph->flags = 0;
+
+	result = gsm_generic_simcom_setup(periph, NULL);
+	if (result) {
+		PRINT(KERN_ERR, "error in generic_simcom_setup");
+		goto out;
+	}
+
+	indigo_peripheral_queue_command(periph, INDIGO_COMMAND_POWER_ON, INDIGO_ORIGIN_BOOT);
+
+	/* flag GPIO_PERIPH_KEEP_ON is set there */
+	indigo_set_keep_on_handler(periph, keep_turned_on_handler_irq);
+
+out:
+	TRACE_EXIT_RES(result);
+	return result;
+}
+EXPORT_SYMBOL(gsm_sim900_setup);
+
+/*
+ * ------------------------------------------------------
+ * ------------------------------------------------------
+ */
+
+/*
+ * SimCOM Sim508 GPS Module (Starterkit devices)
+ *
+ * Manual used is Sim508 Hardware Design 2.08
+ */
+static int gps_sim508_status(struct gpio_peripheral *periph)
+{
+	int power_pin;
+	int result = 0;
+
+	sBUG_ON(periph == NULL);
+
+	power_pin = indigo_gpioperiph_get_pin_by_function(periph, INDIGO_FUNCTION_POWER);
+
+	result = indigo_pin_active_value(&periph->pins[power_pin],
+					gpio_get_value(periph->pins[power_pin].pin_no));
+
+	return result;
+}
+
+/* figure 28 */
+int gps_sim508_power_on(struct gpio_peripheral *periph)
+{
+	int status;
+	int result;
+
+	struct indigo_gpio_sequence_step steps[] = {
+		INDIGO_STEP("1", "set power to on and wait 220 ms",
+			periph, INDIGO_FUNCTION_POWER, 1, true, 220, 0),
+
+	};
+
+	TRACE_ENTRY();
+
+	sBUG_ON(periph == NULL);
+	sBUG_ON(periph->status == NULL);
+
+	if (periph->status(periph)) {
+		printk(KERN_ERR "GPS already seems to work\n");
+		result = -ENODEV;
+		goto out;
+	}
+
+	indigo_gpio_perform_sequence(&steps[0], ARRAY_SIZE(steps));
+
+	status = periph->status(periph);
+	PRINT(KERN_ERR, "device status is %d", status);
+
+	result = !status;
+out:
+	TRACE_EXIT_RES(result);
+	return result;
+}
+
+/* no precise way to nicely turn this off */
+int gps_sim508_power_off(struct gpio_peripheral *periph)
+{
+	struct indigo_gpio_sequence_step steps[] = {
+		INDIGO_STEP("1", "set power to off and wait some time (500 ms)",
+			periph, INDIGO_FUNCTION_POWER, 0, true, 500, 0),
+
+	};
+
+	TRACE_ENTRY();
+
+	sBUG_ON(periph == NULL);
+	sBUG_ON(periph->status == NULL);
+
+	if (!periph->status(periph)) {
+		printk(KERN_ERR "GPS already seems to be turned off\n");
+		sBUG();
+		return -ENODEV;
+	}
+
+	indigo_gpio_perform_sequence(&steps[0], ARRAY_SIZE(steps));
+
+	TRACE_EXIT();
+	return 0;
+}
+
+int gps_sim508_setup(struct gpio_peripheral *periph)
+{
+	TRACE_ENTRY();
+
+	sBUG_ON(periph == NULL);
+
+	indigo_configure_pin(periph, INDIGO_FUNCTION_POWER, /* mandatory */ true);
+
+	indigo_gpioperiph_set_output(periph, INDIGO_FUNCTION_POWER, 1, true);
+
+	periph->power_on = gps_sim508_power_on;
+	periph->power_off = gps_sim508_power_off;
+	periph->status = gps_sim508_status;
+	periph->reset = indigo_generic_reset;
+	periph->check_and_power_on = indigo_check_and_power_on;
+
+	TRACE_EXIT();
+	return 0;
+}
+EXPORT_SYMBOL(gps_sim508_setup);
+/*
+ * ----------------------------------------------------------
+ * ----------------------------------------------------------
+ */
+
+/*
+ * EB-500 GPS Module (Device 1.0)
+ *
+ */
+static int gps_eb500_power_on(struct gpio_peripheral *periph)
+{
+	int result = 0;
+
+	TRACE_ENTRY();
+
+	sBUG_ON(periph == NULL);
+
+	indigo_gpioperiph_set_output(periph, INDIGO_FUNCTION_POWER, 1, true);
+	msleep(200);
+
+	TRACE_EXIT_RES(result);
+	return result;
+}
+
+static int gps_eb500_power_off(struct gpio_peripheral *periph)
+{
+	int result = 0;
+
+	TRACE_ENTRY();
+
+	sBUG_ON(periph == NULL);
+
+	indigo_gpioperiph_set_output(periph, INDIGO_FUNCTION_POWER, 0, true);
+	msleep(500);
+
+	TRACE_EXIT_RES(result);
+	return result;
+}
+
+static int gps_eb500_status(struct gpio_peripheral *periph)
+{
+	int result = 0;
+	int power_pin;
+	int power_pin_value;
+
+	sBUG_ON(periph == NULL);
+
+	power_pin = indigo_gpioperiph_get_pin_by_function(periph,
+							INDIGO_FUNCTION_POWER);
+
+	power_pin_value = gpio_get_value(periph->pins[power_pin].pin_no);
+
+	result = (power_pin_value ==
+		indigo_pin_active_value(&periph->pins[power_pin], power_pin_value));
+
+	return result;
+}
+
+int gps_eb500_setup(struct gpio_peripheral *periph)
+{
+	int result = 0;
+
+	TRACE_ENTRY();
+
+	sBUG_ON(periph == NULL);
+
+	indigo_configure_pin(periph, INDIGO_FUNCTION_POWER, /* mandatory */ true);
+
+	indigo_gpioperiph_set_output(periph, INDIGO_FUNCTION_POWER, 1, true);
+
+	/* FIXME */
+	periph->power_on = gps_eb500_power_on;
+	periph->power_off = gps_eb500_power_off;
+	periph->status = gps_eb500_status;
+	periph->reset = indigo_generic_reset;
+	periph->check_and_power_on = indigo_check_and_power_on;
+
+
+	TRACE_EXIT_RES(result);
+	return result;
+}
+EXPORT_SYMBOL(gps_eb500_setup);
+
+/*
+ * NV80C-CSM GPS/GNSS Module (Hardware V2.1)
+ *
+ */
+
+static int gps_nv08c_csm_power_on(struct gpio_peripheral *periph)
+{
+	int result = 0;
+
+	TRACE_ENTRY();
+
+	sBUG_ON(periph == NULL);
+
+	indigo_gpioperiph_set_output(periph, INDIGO_FUNCTION_POWER, 1, true);
+	msleep(200);
+
+	TRACE_EXIT_RES(result);
+	return result;
+}
+
+int gps_nv08c_csm_power_off(struct gpio_peripheral *periph)
+{
+	int result = 0;
+
+	TRACE_ENTRY();
+
+	sBUG_ON(periph == NULL);
+
+	indigo_gpioperiph_set_output(periph, INDIGO_FUNCTION_POWER, 0, true);
+	msleep(500);
+
+	TRACE_EXIT_RES(result);
+	return result;
+}
+
+/*
+  2.4.2. Сброс
+  Входной сигнал #RESET (#RESET, вывод No25) в NV08C-CSM может быть использован внешней системой
+  * для принудительного сброса цифровой части модуля. Для сброса цифровой части модуля внешняя
+  * система должна обеспечить на входе #RESET нулевой импульс со следующими характеристиками:
+  уровень сигнала не выше 0.3хVCCIO
+  длительность импульса не менее 1 мкс.
+  При этом встроенный в модуль супервизор будет удерживать цифровую часть модуля в
+  состоянии #RESET не менее 140 мс после установки уровня сигнала #RESET из «0» в «1»
+*/
+int gps_nv08c_csm_reset(struct gpio_peripheral *periph)
+{
+	struct indigo_gpio_sequence_step steps[] = {
+
+		INDIGO_STEP("1", "initially, reset is on",
+			periph, INDIGO_FUNCTION_RESET, 1, true, 500, 0),
+
+		INDIGO_STEP("2", "reset to 0 for 1 ms",
+			periph, INDIGO_FUNCTION_RESET, 0, true, 1, 0),
+
+		INDIGO_STEP("3", "reset to 1 for 140 ms",
+			periph, INDIGO_FUNCTION_RESET, 1, true, 140, 0),
+
+		INDIGO_STEP("4", "finally, we have no way to check if everything is ok",
+			NULL, INDIGO_FUNCTION_NO_FUNCTION, 0, true, 0, 0)
+	};
+
+	/* FIXME тут лучше, наверно, использовать STATUS_GPS */
+
+	TRACE_ENTRY();
+
+	sBUG_ON(periph == NULL);
+
+	indigo_gpio_perform_sequence(&steps[0], ARRAY_SIZE(steps));
+
+	TRACE_EXIT_RES(0);
+	return 0; /* 0 is OK code, 1 -- is error */
+}
+
+static int gps_nv08c_csm_status(struct gpio_peripheral *periph)
+{
+	int result = 0;
+	int power_pin;
+	int power_pin_value;
+
+	sBUG_ON(periph == NULL);
+
+	power_pin = indigo_gpioperiph_get_pin_by_function(periph,
+							INDIGO_FUNCTION_POWER);
+
+	power_pin_value = gpio_get_value(periph->pins[power_pin].pin_no);
+
+	result = indigo_pin_active_value(&periph->pins[power_pin], power_pin_value);
+
+	return result;
+}
+
+int gps_nv08c_csm_setup(struct gpio_peripheral *periph)
+{
+	int result = 0;
+
+	TRACE_ENTRY();
+
+	sBUG_ON(periph == NULL);
+
+	periph->status = gps_nv08c_csm_status;
+	periph->reset = gps_nv08c_csm_reset;
+	periph->power_on = gps_nv08c_csm_power_on;
+	periph->power_off = gps_nv08c_csm_power_off;
+	periph->check_and_power_on = indigo_check_and_power_on;
+
+	indigo_configure_pin(periph, INDIGO_FUNCTION_RESET, /* mandatory */ true);
+	indigo_configure_pin(periph, INDIGO_FUNCTION_POWER, /* mandatory */ true);
+
+	TRACE_EXIT_RES(result);
+	return result;
+}
+EXPORT_SYMBOL(gps_nv08c_csm_setup);
+
+/* sysfs interface to previous code */
+
+/*
+ * The default show function that must be passed to sysfs.  This will be
+ * called by sysfs for whenever a show function is called by the user on a
+ * sysfs file associated with the kobjects we have registered.  We need to
+ * transpose back from a "default" kobject to our custom struct foo_obj and
+ * then call the show function for that specific object.
+ */
+static ssize_t gpio_peripheral_attr_show(struct kobject *kobj,
+					struct attribute *attr,
+					char *buf)
+{
+	struct gpio_peripheral_attribute *attribute;
+	struct gpio_peripheral_obj *peripheral_obj;
+	int ret = -EIO;
+
+	attribute = to_gpio_peripheral_attr(attr);
+	peripheral_obj = to_gpio_peripheral_obj(kobj);
+
+	if (attribute->show)
+		ret = attribute->show(peripheral_obj, attribute, buf);
+
+	return ret;
+}
+
+/*
+ * Just like the default show function above, but this one is for when the
+ * sysfs "store" is requested (when a value is written to a file.)
+ */
+static ssize_t gpio_peripheral_attr_store(struct kobject *kobj,
+					struct attribute *attr,
+					const char *buf, size_t len)
+{
+	struct gpio_peripheral_attribute *attribute;
+	struct gpio_peripheral_obj *peripheral_obj;
+	int ret = -EIO;
+
+	attribute = to_gpio_peripheral_attr(attr);
+	peripheral_obj = to_gpio_peripheral_obj(kobj);
+
+	if (attribute->store)
+		ret = attribute->store(peripheral_obj, attribute, buf, len);
+
+	return ret;
+}
+
+static void indigo_rt_thread_stop(struct gpio_peripheral_obj *peripheral_obj);
+
+/*
+ * The release function for our object.  This is REQUIRED by the kernel to
+ * have.  We free the memory held in our object here.
+ *
+ * NEVER try to get away with just a "blank" release function to try to be
+ * smarter than the kernel.  Turns out, no one ever is...
+ */
+static void indigo_gpio_peripheral_obj_release(struct kobject *kobj)
+{
+	struct gpio_peripheral_obj *peripheral_obj;
+	struct indigo_periph_pin *pin;
+	int status;
+	int i;
+
+	TRACE_ENTRY();
+
+	peripheral_obj = to_gpio_peripheral_obj(kobj);
+
+	indigo_rt_thread_stop(peripheral_obj);
+
+	/* handlers point into the object, the hard IRQ half arms settle_timer */
+	if (peripheral_obj->status_irq) {
+		status = indigo_gpioperiph_get_pin_by_function(&peripheral_obj->peripheral,
+							INDIGO_FUNCTION_STATUS);
+		free_irq(gpio_to_irq(peripheral_obj->peripheral.pins[status].pin_no),
+			&peripheral_obj->peripheral);
+	}
+
+	for (i = 0; i < INDIGO_MAX_GPIOPERIPH_PIN_COUNT; i++) {
+		pin = &peripheral_obj->peripheral.pins[i];
+		if (pin->description == NULL)
+			break;
+		if (pin->irq_requested)
+			free_irq(gpio_to_irq(pin->pin_no), pin);
+	}
+
+	cancel_delayed_work_sync(&peripheral_obj->check_status_work);
+	flush_work(&peripheral_obj->run_work);
+
+	for (i = 0; i < INDIGO_MAX_GPIOPERIPH_PIN_COUNT; i++) {
+		pin = &peripheral_obj->peripheral.pins[i];
+		if (pin->description == NULL)
+			break;
+		if (pin->flags & GPIOF_POLLABLE)
+			del_timer_sync(&pin->settle_timer);
+	}
+
+	kfree(peripheral_obj);
+
+	TRACE_EXIT();
+}
+
+static void indigo_peripheral_put_command(struct gpio_peripheral_command *gp_cmd);
+
+/* context: command_lock held */
+static void indigo_journal_add(struct gpio_peripheral_obj *peripheral_obj,
+			struct gpio_peripheral_command *gp_cmd,
+			ktime_t finished)
+{
+	struct indigo_journal_entry *entry;
+
+	entry = &peripheral_obj->journal[peripheral_obj->journal_next % INDIGO_JOURNAL_SIZE];
+	peripheral_obj->journal_next++;
+
+	entry->id = gp_cmd->id;
+	entry->cmd = gp_cmd->cmd;
+	entry->origin = gp_cmd->origin;
+	entry->enqueued = gp_cmd->enqueue_time;
+	entry->started = gp_cmd->start_time;
+	entry->finished = finished;
+	entry->result = gp_cmd->result;
+}
+
+/*
+ * Everything after a command is done: executed, cancelled while queued
+ * or expired. Drops the queue's reference.
+ */
+static void indigo_peripheral_finish_command(struct gpio_peripheral_obj *peripheral_obj,
+					struct gpio_peripheral_command *gp_cmd,
+					int result)
+{
+	struct gpio_peripheral *peripheral = &peripheral_obj->peripheral;
+	ktime_t finished = ktime_get();
+	bool booted = false;
+	int status;
+
+	gp_cmd->result = result;
+	trace_indigo_command_finish(peripheral->name, gp_cmd->id, gp_cmd->cmd, result);
+
+	spin_lock_irq(&peripheral_obj->command_lock);
+	/* nobody joins it from now on */
+	if (peripheral_obj->unfinished[gp_cmd->cmd] == gp_cmd)
+		peripheral_obj->unfinished[gp_cmd->cmd] = NULL;
+	if (peripheral_obj->running == gp_cmd)
+		peripheral_obj->running = NULL;
+	if (peripheral_obj->boot_cmd == gp_cmd) {
+		peripheral_obj->boot_cmd = NULL;
+		booted = true;
+	}
+	peripheral_obj->last_id = gp_cmd->id;
+	peripheral_obj->last_cmd = gp_cmd->cmd;
+	peripheral_obj->last_result = result;
+	indigo_journal_add(peripheral_obj, gp_cmd, finished);
+	atomic_dec(&peripheral_obj->pending);
+	indigo_state_set_commands(peripheral_obj);
+	spin_unlock_irq(&peripheral_obj->command_lock);
+
+	atomic_inc(&peripheral_obj->stats.completed);
+	if (result != 0)
+		atomic_inc(&peripheral_obj->stats.failed);
+	if (peripheral->status != NULL) {
+		/* re-read, but an edge handled meanwhile wins over this read */
+		indigo_status_invalidate(peripheral_obj);
+		status = indigo_peripheral_status(peripheral_obj);
+		indigo_stats_power(peripheral_obj, status);
+	}
+
+	if (booted)
+		printk(KERN_INFO "indigo gpioperiph: %s ready in %lld ms after init\n",
+			peripheral->name, ktime_to_ms(ktime_sub(finished, indigo_enable_time)));
+
+	/* сигнализируем страждущим, их может быть несколько */
+	complete_all(&gp_cmd->complete);
+
+	/* the queue is done with it, gp_cmd may be reused after that */
+	indigo_peripheral_put_command(gp_cmd);
+
+	/* async writers poll() these */
+	sysfs_notify(&peripheral_obj->kobj, NULL, "last_result");
+	sysfs_notify(&peripheral_obj->kobj, NULL, "pending");
+}
+
+/*
+ * выполнить команду в контексте workqueue
+ */
+static void indigo_peripheral_process_command(struct gpio_peripheral_command *gp_cmd)
+{
+	struct gpio_peripheral *peripheral;
+	struct gpio_peripheral_obj *peripheral_obj;
+	int result = 0;
+
+	/* execute command */
+
+	peripheral = gp_cmd->peripheral;
+	peripheral_obj = container_of(peripheral, struct gpio_peripheral_obj, peripheral);
+
+	peripheral_obj->running_cmd = gp_cmd->cmd;
+	indigo_latency_record(&peripheral_obj->latency[gp_cmd->cmd][INDIGO_LATENCY_QUEUE],
+			gp_cmd->enqueue_time, gp_cmd->start_time);
+
+	trace_indigo_command_start(peripheral->name, gp_cmd->id, gp_cmd->cmd);
+
+	/* FIXME how to check NULL here??? < sizeof(struct *)? :-) */
+
+	switch (gp_cmd->cmd) {
+	case INDIGO_COMMAND_NO_COMMAND:
+		PRINT(KERN_INFO, "NO_COMMAND is issued");
+		break;
+	case INDIGO_COMMAND_POWER_ON:
+		sBUG_ON(peripheral->power_on == NULL);
+		result = peripheral->power_on(peripheral);
+		break;
+	case INDIGO_COMMAND_POWER_OFF:
+		sBUG_ON(peripheral->power_off == NULL);
+		result = peripheral->power_off(peripheral);
+		break;
+	case INDIGO_COMMAND_RESET:
+		sBUG_ON(peripheral->reset == NULL);
+		result = peripheral->reset(peripheral);
+		break;
+	case INDIGO_COMMAND_CHECK_AND_POWER_ON:
+		sBUG_ON(peripheral->check_and_power_on == NULL);
+		result = peripheral->check_and_power_on(peripheral);
+		break;
+	default:
+		printk(KERN_ERR "unknown command supplied\n");
+		result = -EINVAL;
 	}
 
-	indigo_gpio_perform_sequence(&steps[0], ARRAY_SIZE(steps));
+	/* cancelled or past its deadline, whatever the callback concluded */
+	if (ACCESS_ONCE(peripheral_obj->abort_reason) != 0)
+		result = peripheral_obj->abort_reason;
 
-	TRACE_EXIT();
-	return 0;
+	indigo_latency_record(&peripheral_obj->latency[gp_cmd->cmd][INDIGO_LATENCY_EXEC],
+			gp_cmd->start_time, ktime_get());
+
+	indigo_peripheral_finish_command(peripheral_obj, gp_cmd, result);
 }
 
-int gps_sim508_setup(struct gpio_peripheral *periph)
+/* context: command_lock held */
+static struct gpio_peripheral_command *indigo_peripheral_next_command(struct gpio_peripheral_obj *peripheral_obj)
 {
-	TRACE_ENTRY();
+	struct gpio_peripheral_command *gp_cmd;
+	int priority;
 
-	sBUG_ON(periph == NULL);
+	for (priority = INDIGO_PRIORITY_COUNT - 1; priority >= 0; priority--) {
+		if (list_empty(&peripheral_obj->queues[priority]))
+			continue;
 
-	indigo_configure_pin(periph, INDIGO_FUNCTION_POWER, /* mandatory */ true);
+		gp_cmd = list_first_entry(&peripheral_obj->queues[priority],
+					struct gpio_peripheral_command, queue_item);
+		list_del_init(&gp_cmd->queue_item);
+		return gp_cmd;
+	}
 
-	indigo_gpioperiph_set_output(periph, INDIGO_FUNCTION_POWER, 1, true);
+	return NULL;
+}
 
-	periph->power_on = gps_sim508_power_on;
-	periph->power_off = gps_sim508_power_off;
-	periph->status = gps_sim508_status;
-	periph->reset = indigo_generic_reset;
-	periph->check_and_power_on = indigo_check_and_power_on;
+static inline bool indigo_command_expired(struct gpio_peripheral_command *gp_cmd,
+					ktime_t now)
+{
+	return ktime_to_ns(gp_cmd->deadline) != 0 &&
+		ktime_to_ns(ktime_sub(now, gp_cmd->deadline)) > 0;
+}
 
-	TRACE_EXIT();
-	return 0;
+/* finish commands taken off the queues with -ECANCELED, returns how many */
+static int indigo_peripheral_cancel_list(struct gpio_peripheral_obj *peripheral_obj,
+					struct list_head *cancelled)
+{
+	struct gpio_peripheral_command *gp_cmd, *tmp;
+	int count = 0;
+
+	list_for_each_entry_safe(gp_cmd, tmp, cancelled, queue_item) {
+		list_del_init(&gp_cmd->queue_item);
+		gp_cmd->start_time = ktime_get();
+		indigo_peripheral_finish_command(peripheral_obj, gp_cmd, -ECANCELED);
+		count++;
+	}
+
+	return count;
 }
-EXPORT_SYMBOL(gps_sim508_setup);
+
 /*
- * ----------------------------------------------------------
- * ----------------------------------------------------------
+ * context: command_lock held
+ *
+ * Take a queued command off the queues to be cancelled: nobody may
+ * join it any more, it's finished once the lock is dropped.
  */
+static void indigo_peripheral_take_cancelled(struct gpio_peripheral_obj *peripheral_obj,
+					struct gpio_peripheral_command *gp_cmd,
+					struct list_head *cancelled)
+{
+	gp_cmd->started = true;
+	if (peripheral_obj->unfinished[gp_cmd->cmd] == gp_cmd)
+		peripheral_obj->unfinished[gp_cmd->cmd] = NULL;
+	list_move_tail(&gp_cmd->queue_item, cancelled);
+}
 
 /*
- * EB-500 GPS Module (Device 1.0)
- *
+ * The only worker of a peripheral: runs queued commands by priority
+ * until the queues are empty. Expired commands fail without running,
+ * superseded ones (see __indigo_peripheral_create_command()) are
+ * finished here as cancelled.
  */
-static int gps_eb500_power_on(struct gpio_peripheral *periph)
+static void indigo_peripheral_run_queue(struct work_struct *work)
 {
-	int result = 0;
+	struct gpio_peripheral_obj *peripheral_obj;
+	struct gpio_peripheral_command *gp_cmd;
+	LIST_HEAD(cancelled);
+
+	peripheral_obj = container_of(work, struct gpio_peripheral_obj, run_work);
+
+	for (;;) {
+		spin_lock_irq(&peripheral_obj->command_lock);
+		list_splice_init(&peripheral_obj->superseded, &cancelled);
+		gp_cmd = indigo_peripheral_next_command(peripheral_obj);
+		if (gp_cmd != NULL) {
+			gp_cmd->started = true;
+			gp_cmd->start_time = ktime_get();
+			peripheral_obj->running = gp_cmd;
+			peripheral_obj->abort_reason = 0;
+			indigo_state_set_commands(peripheral_obj);
+		}
+		spin_unlock_irq(&peripheral_obj->command_lock);
 
-	TRACE_ENTRY();
+		indigo_peripheral_cancel_list(peripheral_obj, &cancelled);
 
-	sBUG_ON(periph == NULL);
+		if (gp_cmd == NULL)
+			break;
 
-	indigo_gpioperiph_set_output(periph, INDIGO_FUNCTION_POWER, 1, true);
-	msleep(200);
+		if (indigo_command_expired(gp_cmd, gp_cmd->start_time)) {
+			indigo_peripheral_finish_command(peripheral_obj, gp_cmd, -ETIMEDOUT);
+			continue;
+		}
 
-	TRACE_EXIT_RES(result);
-	return result;
+		indigo_peripheral_process_command(gp_cmd);
+	}
 }
 
-static int gps_eb500_power_off(struct gpio_peripheral *periph)
+/*
+ * Optional real-time executor: with rt_priority set, every peripheral
+ * gets its own SCHED_FIFO thread which runs its queue instead of
+ * indigo_wq, so sequence timing doesn't suffer when the CPU is saturated
+ * by normal tasks.
+ *
+ * One thread per peripheral, not one for all of them: a command blocks
+ * its executor for the whole sequence, seconds of PWRKEY pulses and
+ * status waits, and can't be interrupted mid-pulse. A shared thread,
+ * round robin or not, would delay every other peripheral by that much.
+ * The default (rt_priority 0) stays on indigo_wq and adds no threads.
+ */
+static int indigo_rt_thread_fn(void *data)
 {
-	int result = 0;
+	struct gpio_peripheral_obj *peripheral_obj = data;
+	bool pending;
 
-	TRACE_ENTRY();
+	for (;;) {
+		wait_event_interruptible(peripheral_obj->rt_wait,
+					ACCESS_ONCE(peripheral_obj->rt_pending) || kthread_should_stop());
 
-	sBUG_ON(periph == NULL);
+		spin_lock_irq(&peripheral_obj->command_lock);
+		pending = peripheral_obj->rt_pending;
+		peripheral_obj->rt_pending = false;
+		spin_unlock_irq(&peripheral_obj->command_lock);
 
-	indigo_gpioperiph_set_output(periph, INDIGO_FUNCTION_POWER, 0, true);
-	msleep(500);
+		if (pending) {
+			indigo_peripheral_run_queue(&peripheral_obj->run_work);
+			continue;
+		}
 
-	TRACE_EXIT_RES(result);
-	return result;
+		/* the queue is drained before we leave */
+		if (kthread_should_stop())
+			break;
+	}
+
+	return 0;
 }
 
-static int gps_eb500_status(struct gpio_peripheral *periph)
+static void indigo_rt_thread_start(struct gpio_peripheral_obj *peripheral_obj)
 {
-	int result = 0;
-	int power_pin;
-	int power_pin_value;
-
-	TRACE_ENTRY();
+	struct sched_param param = { .sched_priority = rt_priority };
+	struct task_struct *thread;
 
-	sBUG_ON(periph == NULL);
+	if (rt_priority <= 0)
+		return;
 
-	power_pin = indigo_gpioperiph_get_pin_by_function(periph,
-							INDIGO_FUNCTION_POWER);
+	if (rt_priority >= MAX_USER_RT_PRIO)
+		param.sched_priority = MAX_USER_RT_PRIO - 1;
 
-	power_pin_value = gpio_get_value(periph->pins[power_pin].pin_no);
+	thread = kthread_run(indigo_rt_thread_fn, peripheral_obj, "indigo_rt/%s",
+			peripheral_obj->peripheral.name);
+	if (IS_ERR(thread)) {
+		printk(KERN_ERR "%s: couldn't start real-time thread, using workqueue\n",
+			peripheral_obj->peripheral.name);
+		return;
+	}
 
-	result = (power_pin_value ==
-		indigo_pin_active_value(&periph->pins[power_pin], power_pin_value));
+	sched_setscheduler(thread, SCHED_FIFO, &param);
 
-	TRACE_EXIT_RES(result);
-	return result;
+	spin_lock_irq(&peripheral_obj->command_lock);
+	peripheral_obj->rt_thread = thread;
+	spin_unlock_irq(&peripheral_obj->command_lock);
 }
 
-int gps_eb500_setup(struct gpio_peripheral *periph)
+/*
+ * Refuse new commands, then run what's queued and stop the real-time
+ * thread. Whatever was kicked meanwhile went to indigo_wq, the caller
+ * flushes run_work after check_status_work is gone.
+ */
+static void indigo_rt_thread_stop(struct gpio_peripheral_obj *peripheral_obj)
 {
-	int result = 0;
-
-	TRACE_ENTRY();
-
-	sBUG_ON(periph == NULL);
+	struct task_struct *thread;
 
-	indigo_configure_pin(periph, INDIGO_FUNCTION_POWER, /* mandatory */ true);
+	spin_lock_irq(&peripheral_obj->command_lock);
+	peripheral_obj->closed = true;
+	thread = peripheral_obj->rt_thread;
+	peripheral_obj->rt_thread = NULL;
+	spin_unlock_irq(&peripheral_obj->command_lock);
 
-	indigo_gpioperiph_set_output(periph, INDIGO_FUNCTION_POWER, 1, true);
+	if (thread != NULL)
+		kthread_stop(thread);
+}
 
-	/* FIXME */
-	periph->power_on = gps_eb500_power_on;
-	periph->power_off = gps_eb500_power_off;
-	periph->status = gps_eb500_status;
-	periph->reset = indigo_generic_reset;
-	periph->check_and_power_on = indigo_check_and_power_on;
+/* context: any */
+static void indigo_peripheral_kick(struct gpio_peripheral_obj *peripheral_obj)
+{
+	unsigned long flags = 0;
+	bool rt;
 
+	spin_lock_irqsave(&peripheral_obj->command_lock, flags);
+	rt = peripheral_obj->rt_thread != NULL;
+	if (rt)
+		peripheral_obj->rt_pending = true;
+	spin_unlock_irqrestore(&peripheral_obj->command_lock, flags);
 
-	TRACE_EXIT_RES(result);
-	return result;
+	if (rt)
+		wake_up(&peripheral_obj->rt_wait);
+	else
+		queue_work(indigo_wq, &peripheral_obj->run_work);
 }
-EXPORT_SYMBOL(gps_eb500_setup);
 
 /*
- * NV80C-CSM GPS/GNSS Module (Hardware V2.1)
- *
+ * Sequences call it at every step boundary and while waiting for
+ * status: non-zero means stop and return it.
  */
-
-static int gps_nv08c_csm_power_on(struct gpio_peripheral *periph)
+static int indigo_peripheral_abort_reason(struct gpio_peripheral *periph)
 {
-	int result = 0;
-
-	TRACE_ENTRY();
+	struct gpio_peripheral_obj *peripheral_obj;
+	struct gpio_peripheral_command *running;
 
-	sBUG_ON(periph == NULL);
+	peripheral_obj = container_of(periph, struct gpio_peripheral_obj, peripheral);
 
-	indigo_gpioperiph_set_output(periph, INDIGO_FUNCTION_POWER, 1, true);
-	msleep(200);
+	/*
+	 * only the worker changes running to and from non-NULL, and clears
+	 * abort_reason; the first reason set stays, whoever sets it
+	 */
+	running = ACCESS_ONCE(peripheral_obj->running);
+	if (running != NULL && ACCESS_ONCE(peripheral_obj->abort_reason) == 0 &&
+		indigo_command_expired(running, ktime_get()))
+		cmpxchg(&peripheral_obj->abort_reason, 0, -ETIMEDOUT);
 
-	TRACE_EXIT_RES(result);
-	return result;
+	return ACCESS_ONCE(peripheral_obj->abort_reason);
 }
 
-int gps_nv08c_csm_power_off(struct gpio_peripheral *periph)
+/* context: command_lock held */
+static void indigo_peripheral_abort_running(struct gpio_peripheral_obj *peripheral_obj,
+					int reason)
 {
-	int result = 0;
-
-	TRACE_ENTRY();
-
-	sBUG_ON(periph == NULL);
+	if (peripheral_obj->running == NULL)
+		return;
 
-	indigo_gpioperiph_set_output(periph, INDIGO_FUNCTION_POWER, 0, true);
-	msleep(500);
+	/* indigo_peripheral_abort_reason() sets it without the lock */
+	if (cmpxchg(&peripheral_obj->abort_reason, 0, reason) != 0)
+		return;
 
-	TRACE_EXIT_RES(result);
-	return result;
+	/* status waits notice it right away */
+	wake_up_all(&peripheral_obj->status_wait);
 }
 
 /*
-  2.4.2. Сброс
-  Входной сигнал #RESET (#RESET, вывод No25) в NV08C-CSM может быть использован внешней системой
-  * для принудительного сброса цифровой части модуля. Для сброса цифровой части модуля внешняя
-  * система должна обеспечить на входе #RESET нулевой импульс со следующими характеристиками:
-  уровень сигнала не выше 0.3хVCCIO
-  длительность импульса не менее 1 мкс.
-  При этом встроенный в модуль супервизор будет удерживать цифровую часть модуля в
-  состоянии #RESET не менее 140 мс после установки уровня сигнала #RESET из «0» в «1»
-*/
-int gps_nv08c_csm_reset(struct gpio_peripheral *periph)
+ * Cancel queued command @id, or every queued command if @id is 0.
+ * The running one is aborted too if @running is set (and @id matches).
+ * Returns how many commands were cancelled or aborted.
+ */
+static int indigo_peripheral_cancel(struct gpio_peripheral_obj *peripheral_obj,
+				u32 id, bool running)
 {
-	struct indigo_gpio_sequence_step steps[] = {
-
-		{"1", "initially, reset is on",
-		 periph, INDIGO_FUNCTION_RESET, 1, true, 500, 0},
+	struct gpio_peripheral_command *gp_cmd, *tmp;
+	LIST_HEAD(cancelled);
+	int priority;
+	int count = 0;
 
-		{"2", "reset to 0 for 1 ms",
-		 periph, INDIGO_FUNCTION_RESET, 0, true, 1, 0},
+	spin_lock_irq(&peripheral_obj->command_lock);
+	for (priority = 0; priority < INDIGO_PRIORITY_COUNT; priority++) {
+		list_for_each_entry_safe(gp_cmd, tmp, &peripheral_obj->queues[priority], queue_item) {
+			if (id != 0 && gp_cmd->id != id)
+				continue;
 
-		{"3", "reset to 1 for 140 ms",
-		 periph, INDIGO_FUNCTION_RESET, 1, true, 140, 0},
+			indigo_peripheral_take_cancelled(peripheral_obj, gp_cmd, &cancelled);
+		}
+	}
 
-		{"4", "finally, we have no way to check if everything is ok",
-		 NULL, INDIGO_FUNCTION_NO_FUNCTION, 0, true, 0, 0}
-	};
+	if (running && peripheral_obj->running != NULL &&
+		(id == 0 || peripheral_obj->running->id == id)) {
+		indigo_peripheral_abort_running(peripheral_obj, -ECANCELED);
+		count++;
+	}
+	spin_unlock_irq(&peripheral_obj->command_lock);
 
-	/* FIXME тут лучше, наверно, использовать STATUS_GPS */
+	return count + indigo_peripheral_cancel_list(peripheral_obj, &cancelled);
+}
 
-	TRACE_ENTRY();
+/*
+ * Command slots: commands[] never move, free ones are kept in
+ * free_slots[] ring, taken from its head and returned to its tail.
+ *
+ * CONTEXT: command_lock held
+ */
+static struct gpio_peripheral_command *indigo_command_slot_get(struct gpio_peripheral_obj *peripheral_obj)
+{
+	struct gpio_peripheral_command *gp_cmd;
 
-	sBUG_ON(periph == NULL);
+	if (peripheral_obj->free_count == 0)
+		return NULL;
 
-	indigo_gpio_perform_sequence(&steps[0], ARRAY_SIZE(steps));
+	gp_cmd = &peripheral_obj->commands[peripheral_obj->free_slots[peripheral_obj->free_head]];
+	peripheral_obj->free_head = (peripheral_obj->free_head + 1) % INDIGO_COMMAND_RING_SIZE;
+	peripheral_obj->free_count--;
 
-	TRACE_EXIT_RES(0);
-	return 0; /* 0 is OK code, 1 -- is error */
+	return gp_cmd;
 }
 
-static int gps_nv08c_csm_status(struct gpio_peripheral *periph)
+static void indigo_command_slot_put(struct gpio_peripheral_obj *peripheral_obj,
+				struct gpio_peripheral_command *gp_cmd)
 {
-	int result = 0;
-	int power_pin;
-	int power_pin_value;
+	unsigned int tail;
 
-	TRACE_ENTRY();
+	sBUG_ON(peripheral_obj->free_count >= INDIGO_COMMAND_RING_SIZE);
 
-	sBUG_ON(periph == NULL);
+	tail = (peripheral_obj->free_head + peripheral_obj->free_count) % INDIGO_COMMAND_RING_SIZE;
+	peripheral_obj->free_slots[tail] = gp_cmd - peripheral_obj->commands;
+	peripheral_obj->free_count++;
+}
 
-	power_pin = indigo_gpioperiph_get_pin_by_function(periph,
-							INDIGO_FUNCTION_POWER);
+static void indigo_command_slots_init(struct gpio_peripheral_obj *peripheral_obj)
+{
+	int i;
 
-	power_pin_value = gpio_get_value(periph->pins[power_pin].pin_no);
+	for (i = 0; i < INDIGO_PRIORITY_COUNT; i++)
+		INIT_LIST_HEAD(&peripheral_obj->queues[i]);
+	INIT_LIST_HEAD(&peripheral_obj->superseded);
+	INIT_WORK(&peripheral_obj->run_work, indigo_peripheral_run_queue);
+	init_waitqueue_head(&peripheral_obj->rt_wait);
 
-	result = indigo_pin_active_value(&periph->pins[power_pin], power_pin_value);
+	for (i = 0; i < INDIGO_COMMAND_RING_SIZE; i++) {
+		INIT_LIST_HEAD(&peripheral_obj->commands[i].queue_item);
+		peripheral_obj->commands[i].peripheral = &peripheral_obj->peripheral;
+		peripheral_obj->free_slots[i] = i;
+	}
 
-	TRACE_EXIT_RES(result);
-	return result;
+	peripheral_obj->free_head = 0;
+	peripheral_obj->free_count = INDIGO_COMMAND_RING_SIZE;
 }
 
-int gps_nv08c_csm_setup(struct gpio_peripheral *periph)
+/* last reference returns the slot, from any context */
+static void indigo_peripheral_put_command(struct gpio_peripheral_command *gp_cmd)
 {
-	int result = 0;
-
-	TRACE_ENTRY();
-
-	sBUG_ON(periph == NULL);
+	struct gpio_peripheral_obj *peripheral_obj;
+	unsigned long flags = 0;
 
-	periph->status = gps_nv08c_csm_status;
-	periph->reset = gps_nv08c_csm_reset;
-	periph->power_on = gps_nv08c_csm_power_on;
-	periph->power_off = gps_nv08c_csm_power_off;
-	periph->check_and_power_on = indigo_check_and_power_on;
+	if (!atomic_dec_and_test(&gp_cmd->refs))
+		return;
 
-	indigo_configure_pin(periph, INDIGO_FUNCTION_RESET, /* mandatory */ true);
-	indigo_configure_pin(periph, INDIGO_FUNCTION_POWER, /* mandatory */ true);
+	peripheral_obj = container_of(gp_cmd->peripheral, struct gpio_peripheral_obj, peripheral);
 
-	TRACE_EXIT_RES(result);
-	return result;
+	spin_lock_irqsave(&peripheral_obj->command_lock, flags);
+	indigo_command_slot_put(peripheral_obj, gp_cmd);
+	spin_unlock_irqrestore(&peripheral_obj->command_lock, flags);
 }
-EXPORT_SYMBOL(gps_nv08c_csm_setup);
-
-/* sysfs interface to previous code */
 
 /*
- * The default show function that must be passed to sysfs.  This will be
- * called by sysfs for whenever a show function is called by the user on a
- * sysfs file associated with the kobjects we have registered.  We need to
- * transpose back from a "default" kobject to our custom struct foo_obj and
- * then call the show function for that specific object.
+ * context: command_lock held
+ *
+ * Is a command of another kind going to run after @gp_cmd once it sits
+ * at @priority? Joining it then would report a state that doesn't last.
  */
-static ssize_t gpio_peripheral_attr_show(struct kobject *kobj,
-					struct attribute *attr,
-					char *buf)
+static bool indigo_peripheral_command_followed(struct gpio_peripheral_obj *peripheral_obj,
+					struct gpio_peripheral_command *gp_cmd,
+					enum indigo_command_priority_t priority)
 {
-	struct gpio_peripheral_attribute *attribute;
-	struct gpio_peripheral_obj *peripheral_obj;
-	int ret = -EIO;
-
-	attribute = to_gpio_peripheral_attr(attr);
-	peripheral_obj = to_gpio_peripheral_obj(kobj);
+	struct gpio_peripheral_command *other;
+	bool after;
+	int p;
+
+	for (p = INDIGO_PRIORITY_COUNT - 1; p >= 0; p--) {
+		/* raised to @priority it goes to the tail of that queue */
+		after = gp_cmd->started || p < (int) priority;
+
+		list_for_each_entry(other, &peripheral_obj->queues[p], queue_item) {
+			if (other == gp_cmd) {
+				after = true;
+				continue;
+			}
 
-	if (attribute->show)
-		ret = attribute->show(peripheral_obj, attribute, buf);
+			if (after && other->cmd != gp_cmd->cmd)
+				return true;
+		}
+	}
 
-	return ret;
+	return false;
 }
 
 /*
- * Just like the default show function above, but this one is for when the
- * sysfs "store" is requested (when a value is written to a file.)
+ * context: command_lock held
+ *
+ * May a new @command join unfinished @gp_cmd of the same kind?
+ * CHECK_AND_POWER_ON only merges with a queued one: a running check may
+ * have sampled status before the edge that caused the new request.
  */
-static ssize_t gpio_peripheral_attr_store(struct kobject *kobj,
-					struct attribute *attr,
-					const char *buf, size_t len)
+static bool indigo_peripheral_command_joinable(struct gpio_peripheral_obj *peripheral_obj,
+					struct gpio_peripheral_command *gp_cmd,
+					enum indigo_gpioperiph_command_t command,
+					enum indigo_command_priority_t priority)
 {
-	struct gpio_peripheral_attribute *attribute;
-	struct gpio_peripheral_obj *peripheral_obj;
-	int ret = -EIO;
+	if (gp_cmd == NULL)
+		return false;
 
-	attribute = to_gpio_peripheral_attr(attr);
-	peripheral_obj = to_gpio_peripheral_obj(kobj);
+	if (command == INDIGO_COMMAND_CHECK_AND_POWER_ON && gp_cmd->started)
+		return false;
 
-	if (attribute->store)
-		ret = attribute->store(peripheral_obj, attribute, buf, len);
+	return !indigo_peripheral_command_followed(peripheral_obj, gp_cmd,
+						max(priority, gp_cmd->priority));
+}
 
-	return ret;
+/* default priority: userspace power_off is urgent, background work is low */
+static enum indigo_command_priority_t indigo_command_priority(enum indigo_gpioperiph_command_t command,
+							enum indigo_command_origin_t origin)
+{
+	if (origin == INDIGO_ORIGIN_KEEP_ON || origin == INDIGO_ORIGIN_BOOT)
+		return INDIGO_PRIORITY_LOW;
+
+	if (command == INDIGO_COMMAND_POWER_OFF)
+		return INDIGO_PRIORITY_URGENT;
+
+	return INDIGO_PRIORITY_NORMAL;
 }
 
-/*
- * The release function for our object.  This is REQUIRED by the kernel to
- * have.  We free the memory held in our object here.
+/* создать, поместить в очередь
  *
- * NEVER try to get away with just a "blank" release function to try to be
- * smarter than the kernel.  Turns out, no one ever is...
+ * Returns command with a reference held for the caller, drop it with
+ * indigo_peripheral_put_command(). If the same command is already
+ * queued or running and nothing of another kind is queued after it,
+ * the caller gets that one instead of a new one, raised to @priority
+ * if that's higher; its deadline stays as it was.
+ * -EBUSY when max_queue_depth commands are not finished yet or
+ * all command slots are taken.
+ * -ESHUTDOWN once the peripheral is being released.
+ *
+ * @deadline_ms is relative to now, 0 -- none
+ *
+ * CONTEXT: atomic or process, nothing is allocated here
  */
-static void indigo_gpio_peripheral_obj_release(struct kobject *kobj)
+static struct gpio_peripheral_command *__indigo_peripheral_create_command(struct gpio_peripheral *peripheral,
+						enum indigo_gpioperiph_command_t command,
+						enum indigo_command_origin_t origin,
+						enum indigo_command_priority_t priority,
+						unsigned int deadline_ms)
 {
+	struct gpio_peripheral_command *gp_cmd, *other, *tmp;
 	struct gpio_peripheral_obj *peripheral_obj;
+	unsigned long flags = 0;
+	int p;
+
+	sBUG_ON(peripheral == NULL);
+	sBUG_ON(command >= INDIGO_COMMAND_COUNT);
+	sBUG_ON(priority >= INDIGO_PRIORITY_COUNT);
+	peripheral_obj = container_of(peripheral, struct gpio_peripheral_obj, peripheral);
+
+	spin_lock_irqsave(&peripheral_obj->command_lock, flags);
 
-	TRACE_ENTRY();
+	if (peripheral_obj->closed) {
+		spin_unlock_irqrestore(&peripheral_obj->command_lock, flags);
+		gp_cmd = ERR_PTR(-ESHUTDOWN);
+		goto out;
+	}
 
-	peripheral_obj = to_gpio_peripheral_obj(kobj);
+	gp_cmd = peripheral_obj->unfinished[command];
+	if (indigo_peripheral_command_joinable(peripheral_obj, gp_cmd, command, priority)) {
+		/* the queue still holds it, refs can't be 0 here */
+		atomic_inc(&gp_cmd->refs);
 
-	flush_workqueue(peripheral_obj->wq);
-	destroy_workqueue(peripheral_obj->wq);
+		if (priority > gp_cmd->priority) {
+			gp_cmd->priority = priority;
+			if (!gp_cmd->started)
+				list_move_tail(&gp_cmd->queue_item,
+					&peripheral_obj->queues[priority]);
+		}
+		spin_unlock_irqrestore(&peripheral_obj->command_lock, flags);
 
-	kfree(peripheral_obj);
+		atomic_inc(&peripheral_obj->stats.submitted);
+		atomic_inc(&peripheral_obj->stats.coalesced);
 
-	TRACE_EXIT();
-}
+		trace_indigo_command_enqueue(peripheral->name, gp_cmd->id, command, true);
+		goto out;
+	}
 
-/*
- * выполнить команду из work_struct в контексте workqueue
- */
-static void indigo_peripheral_process_command(struct work_struct *command)
-{
-	struct gpio_peripheral_command *gp_cmd;
-	struct gpio_peripheral *peripheral;
-	struct gpio_peripheral_obj *peripheral_obj;
+	if (atomic_read(&peripheral_obj->pending) >= max_queue_depth)
+		gp_cmd = NULL;
+	else
+		gp_cmd = indigo_command_slot_get(peripheral_obj);
 
-	TRACE_ENTRY();
+	if (gp_cmd == NULL) {
+		spin_unlock_irqrestore(&peripheral_obj->command_lock, flags);
 
-	/* execute command */
+		/* -EBUSY tells the caller, this is for whoever reads the log */
+		if (printk_ratelimit())
+			printk(KERN_ERR "%s: command queue is full\n", peripheral->name);
+		gp_cmd = ERR_PTR(-EBUSY);
+		goto out;
+	}
 
-	gp_cmd = container_of(command, struct gpio_peripheral_command, work);
-	peripheral = gp_cmd->peripheral;
-	peripheral_obj = container_of(peripheral, struct gpio_peripheral_obj, peripheral);
+	gp_cmd->cmd = command;
+	gp_cmd->result = 0;
+	gp_cmd->started = false;
+	gp_cmd->origin = origin;
+	gp_cmd->priority = priority;
+	/* one for the queue, one for the caller */
+	atomic_set(&gp_cmd->refs, 2);
+	init_completion(&gp_cmd->complete);
+	gp_cmd->id = atomic_inc_return(&peripheral_obj->command_seq);
+	gp_cmd->enqueue_time = ktime_get();
+	gp_cmd->deadline = ktime_set(0, 0);
+	if (deadline_ms != 0)
+		gp_cmd->deadline = indigo_ktime_add_ms(gp_cmd->enqueue_time, deadline_ms);
 
-	/* FIXME how to check NULL here??? < sizeof(struct *)? :-) */
+	peripheral_obj->unfinished[command] = gp_cmd;
+	atomic_inc(&peripheral_obj->pending);
+	list_add_tail(&gp_cmd->queue_item, &peripheral_obj->queues[priority]);
+	indigo_state_set_commands(peripheral_obj);
 
-	switch (gp_cmd->cmd) {
-	case INDIGO_COMMAND_NO_COMMAND:
-		printk(KERN_INFO "NO_COMMAND is issued\n");
-		break;
-	case INDIGO_COMMAND_POWER_ON:
-		sBUG_ON(peripheral->power_on == NULL);
-		peripheral->power_on(peripheral);
-		break;
-	case INDIGO_COMMAND_POWER_OFF:
-		sBUG_ON(peripheral->power_off == NULL);
-		peripheral->power_off(peripheral);
-		break;
-	case INDIGO_COMMAND_RESET:
-		sBUG_ON(peripheral->reset == NULL);
-		peripheral->reset(peripheral);
-		break;
-	case INDIGO_COMMAND_CHECK_AND_POWER_ON:
-		sBUG_ON(peripheral->check_and_power_on == NULL);
-		peripheral->check_and_power_on(peripheral);
-		break;
-	default:
-		printk(KERN_ERR "unknown command supplied\n");
+	/*
+	 * it runs first, so power ons queued before it would run after it:
+	 * "on, then off" has to end up off, they are cancelled instead
+	 */
+	if (command == INDIGO_COMMAND_POWER_OFF && priority == INDIGO_PRIORITY_URGENT) {
+		for (p = 0; p < INDIGO_PRIORITY_URGENT; p++) {
+			list_for_each_entry_safe(other, tmp, &peripheral_obj->queues[p], queue_item) {
+				if (other->cmd != INDIGO_COMMAND_POWER_ON &&
+					other->cmd != INDIGO_COMMAND_CHECK_AND_POWER_ON)
+					continue;
+
+				/* sysfs_notify() may sleep, run_work finishes them */
+				indigo_peripheral_take_cancelled(peripheral_obj, other,
+								&peripheral_obj->superseded);
+			}
+		}
 	}
 
-	/* сигнализируем страждущим */
-	complete(&gp_cmd->complete);
+	/* urgent one doesn't wait for a long sequence to finish */
+	if (peripheral_obj->running != NULL &&
+		priority == INDIGO_PRIORITY_URGENT &&
+		peripheral_obj->running->priority < INDIGO_PRIORITY_URGENT)
+		indigo_peripheral_abort_running(peripheral_obj, -ECANCELED);
 
-	TRACE_EXIT();
+	spin_unlock_irqrestore(&peripheral_obj->command_lock, flags);
+
+	atomic_inc(&peripheral_obj->stats.submitted);
+	trace_indigo_command_enqueue(peripheral->name, gp_cmd->id, command, false);
+	indigo_peripheral_kick(peripheral_obj);
+
+out:
+	return gp_cmd;
 }
 
-/* not safe to free commands inside work struct handler, let's postpone command kfree */
-static void indigo_peripheral_free_completed_commands(struct gpio_peripheral_obj *peripheral_obj)
+/* default priority and deadline */
+static struct gpio_peripheral_command *indigo_peripheral_create_command(struct gpio_peripheral *peripheral,
+						enum indigo_gpioperiph_command_t command,
+						enum indigo_command_origin_t origin)
 {
-	struct gpio_peripheral_command *gp_cmd, *tmp;
-	unsigned long flags = 0;
+	struct gpio_peripheral_obj *peripheral_obj;
 
-	TRACE_ENTRY();
+	peripheral_obj = container_of(peripheral, struct gpio_peripheral_obj, peripheral);
 
-	// FIXME check locking !!!!!!!!!!!!!!!!!!!!!!!!!
+	return __indigo_peripheral_create_command(peripheral, command, origin,
+						indigo_command_priority(command, origin),
+						peripheral_obj->command_deadline_ms);
+}
+
+/* fire and forget, for setup and keep-on */
+static int indigo_peripheral_queue_command(struct gpio_peripheral *peripheral,
+					enum indigo_gpioperiph_command_t command,
+					enum indigo_command_origin_t origin)
+{
+	struct gpio_peripheral_obj *peripheral_obj;
+	struct gpio_peripheral_command *gp_cmd;
 
-	spin_lock_irqsave(&peripheral_obj->command_list_lock, flags);
+	gp_cmd = indigo_peripheral_create_command(peripheral, command, origin);
+	if (IS_ERR(gp_cmd))
+		return PTR_ERR(gp_cmd);
 
-	list_for_each_entry_safe(gp_cmd, tmp, &peripheral_obj->command_list, command_sequence) {
-		if (completion_done(&gp_cmd->complete)) {
-			list_del(&gp_cmd->command_sequence);
-			/* FIXME SLUB */
-			kmem_cache_free(indigo_cmd_mem_cache, gp_cmd);
-		}
+	/* boot commands share a priority, so the last one finishes last */
+	if (origin == INDIGO_ORIGIN_BOOT) {
+		peripheral_obj = container_of(peripheral, struct gpio_peripheral_obj, peripheral);
+		spin_lock_irq(&peripheral_obj->command_lock);
+		peripheral_obj->boot_cmd = gp_cmd;
+		spin_unlock_irq(&peripheral_obj->command_lock);
 	}
 
-	spin_unlock_irqrestore(&peripheral_obj->command_list_lock, flags);
-
-	TRACE_EXIT();
+	indigo_peripheral_put_command(gp_cmd);
+	return 0;
 }
 
-/* создать, поместить в очередь
- *
- * CONTEXT: atomic or process
- */
-struct completion *indigo_peripheral_create_command(struct gpio_peripheral *peripheral,
-						enum indigo_gpioperiph_command_t command)
+/* callbacks return 1 on failure, or -errno */
+static inline int indigo_command_errno(int result)
 {
-	struct gpio_peripheral_command *gp_cmd;
-	struct gpio_peripheral_obj *peripheral_obj;
-
-	TRACE_ENTRY();
+	if (result > 0)
+		return -EIO;
 
-	printk(KERN_ERR "%s: creating command %d\n", peripheral->name, command);
+	return result;
+}
 
-	sBUG_ON(peripheral == NULL);
-	peripheral_obj = container_of(peripheral, struct gpio_peripheral_obj, peripheral);
+/*
+ * What a sysfs writer gets back for @gp_cmd: in async mode the write
+ * returns at once and the result shows up in last_result, otherwise
+ * the writer waits and gets the real result of the command.
+ */
+static ssize_t indigo_peripheral_command_result(struct gpio_peripheral_obj *peripheral_obj,
+						struct gpio_peripheral_command *gp_cmd,
+						size_t count)
+{
+	ssize_t result = count;
 
-	gp_cmd = kmem_cache_zalloc(indigo_cmd_mem_cache, GFP_KERNEL);
-	if (!gp_cmd) {
-		printk(KERN_ERR "no memory for gp_cmd\n");
+	if (IS_ERR(gp_cmd)) {
+		result = PTR_ERR(gp_cmd);
 		goto out;
 	}
 
-	gp_cmd->cmd = command;
-	gp_cmd->peripheral = peripheral;
+	if (peripheral_obj->async)
+		goto free;
 
-	INIT_WORK(&gp_cmd->work, indigo_peripheral_process_command);
-	INIT_LIST_HEAD(&gp_cmd->command_sequence);
-	list_add_tail(&gp_cmd->command_sequence, &peripheral_obj->command_list);
-	init_completion(&gp_cmd->complete);
+	/* not -ERESTARTSYS, restarted write would queue the command again */
+	if (wait_for_completion_interruptible(&gp_cmd->complete)) {
+		result = -EINTR;
+		goto free;
+	}
 
-	queue_work(peripheral_obj->wq, &gp_cmd->work);
+	if (indigo_command_errno(gp_cmd->result))
+		result = indigo_command_errno(gp_cmd->result);
 
+free:
+	indigo_peripheral_put_command(gp_cmd);
 out:
-	TRACE_EXIT();
-	return &gp_cmd->complete;
+	return result;
+}
+
+static const char *indigo_command_names[] = {
+	[INDIGO_COMMAND_NO_COMMAND] = "no_command",
+	[INDIGO_COMMAND_POWER_ON] = "power_on",
+	[INDIGO_COMMAND_POWER_OFF] = "power_off",
+	[INDIGO_COMMAND_RESET] = "reset",
+	[INDIGO_COMMAND_CHECK_AND_POWER_ON] = "check_and_power_on",
+	[INDIGO_COMMAND_STATE_TRANSITION] = "state_transition",
+};
+
+static const char *indigo_command_name(enum indigo_gpioperiph_command_t command)
+{
+	if (command < ARRAY_SIZE(indigo_command_names) &&
+		indigo_command_names[command] != NULL)
+		return indigo_command_names[command];
+
+	return "unknown";
 }
 
 /* here interfaces go */
@@ -1466,6 +3330,7 @@ static ssize_t status_show(struct gpio_peripheral_obj *peripheral_obj, struct gp
 {
 	struct gpio_peripheral *periph;
 	ssize_t len = 0;
+	int status;
 
 	TRACE_ENTRY();
 
@@ -1474,10 +3339,11 @@ static ssize_t status_show(struct gpio_peripheral_obj *peripheral_obj, struct gp
 	periph = &peripheral_obj->peripheral;
 	(void) attr;
 
-	if (periph->status(periph) &&
-		((periph->flags & GPIO_PERIPH_FLAG_KEEP_ON) != 0))
+	status = indigo_peripheral_status(peripheral_obj);
+
+	if (status && ((periph->flags & GPIO_PERIPH_FLAG_KEEP_ON) != 0))
 		len = sprintf(buf, "on-keep\n");
-	else if (periph->status(periph))
+	else if (status)
 		len = sprintf(buf, "on\n");
 	else
 		len = sprintf(buf, "off\n");
@@ -1493,7 +3359,8 @@ static ssize_t status_store(struct gpio_peripheral_obj
 			struct gpio_peripheral_attribute *attr,
 			const char *buf, size_t count)
 {
-	struct completion *complete;
+	struct gpio_peripheral_command *gp_cmd;
+	ssize_t result = count;
 
 	(void) attr;
 
@@ -1504,14 +3371,16 @@ static ssize_t status_store(struct gpio_peripheral_obj
 	/* FIXME вкл или выкл */
 	/* FIXME update flags */
 	if (strstr(buf, "on-keep")) {
-		complete = indigo_peripheral_create_command(&peripheral_obj->peripheral,
-							INDIGO_COMMAND_POWER_ON);
+		gp_cmd = indigo_peripheral_create_command(&peripheral_obj->peripheral,
+							INDIGO_COMMAND_POWER_ON,
+							INDIGO_ORIGIN_SYSFS);
 		indigo_set_keep_on_handler(&peripheral_obj->peripheral,
 					keep_turned_on_handler_irq);
 
 	} else if (strstr(buf, "on")) {
-		complete = indigo_peripheral_create_command(&peripheral_obj->peripheral,
-							INDIGO_COMMAND_POWER_ON);
+		gp_cmd = indigo_peripheral_create_command(&peripheral_obj->peripheral,
+							INDIGO_COMMAND_POWER_ON,
+							INDIGO_ORIGIN_SYSFS);
 		indigo_set_keep_on_handler(&peripheral_obj->peripheral,
 					NULL);
 
@@ -1519,21 +3388,370 @@ static ssize_t status_store(struct gpio_peripheral_obj
 		indigo_set_keep_on_handler(&peripheral_obj->peripheral,
 					NULL);
 
-		complete = indigo_peripheral_create_command(&peripheral_obj->peripheral,
-							INDIGO_COMMAND_POWER_OFF);
+		gp_cmd = indigo_peripheral_create_command(&peripheral_obj->peripheral,
+							INDIGO_COMMAND_POWER_OFF,
+							INDIGO_ORIGIN_SYSFS);
 
 	} else {
 		printk(KERN_ERR "unknown command given: %s\n", buf);
 		goto out;
 	}
-	wait_for_completion_interruptible(complete);
-	indigo_peripheral_free_completed_commands(peripheral_obj);
+
+	result = indigo_peripheral_command_result(peripheral_obj, gp_cmd, count);
 
 out:
 	TRACE_EXIT();
+	return result;
+}
+
+static ssize_t async_show(struct gpio_peripheral_obj *peripheral_obj,
+			struct gpio_peripheral_attribute *attr,
+			char *buf)
+{
+	(void) attr;
+
+	return sprintf(buf, "%d\n", peripheral_obj->async);
+}
+
+static ssize_t async_store(struct gpio_peripheral_obj *peripheral_obj,
+			struct gpio_peripheral_attribute *attr,
+			const char *buf, size_t count)
+{
+	int value;
+
+	(void) attr;
+
+	if (sscanf(buf, "%d", &value) != 1)
+		return -EINVAL;
+
+	peripheral_obj->async = (value != 0);
+
+	return count;
+}
+
+/* last submitted command id and how many commands are not finished yet */
+static ssize_t pending_show(struct gpio_peripheral_obj *peripheral_obj,
+			struct gpio_peripheral_attribute *attr,
+			char *buf)
+{
+	(void) attr;
+
+	return sprintf(buf, "submitted %u pending %d\n",
+		(u32) atomic_read(&peripheral_obj->command_seq),
+		atomic_read(&peripheral_obj->pending));
+}
+
+static ssize_t last_result_show(struct gpio_peripheral_obj *peripheral_obj,
+				struct gpio_peripheral_attribute *attr,
+				char *buf)
+{
+	u32 id;
+	enum indigo_gpioperiph_command_t cmd;
+	int result;
+
+	(void) attr;
+
+	spin_lock_irq(&peripheral_obj->command_lock);
+	id = peripheral_obj->last_id;
+	cmd = peripheral_obj->last_cmd;
+	result = peripheral_obj->last_result;
+	spin_unlock_irq(&peripheral_obj->command_lock);
+
+	return sprintf(buf, "id %u command %s result %d\n",
+		id, indigo_command_name(cmd), result);
+}
+
+/* keep-on policy knobs, see indigo_check_status() */
+#define INDIGO_KEEP_ON_ATTR(field)					\
+static ssize_t field##_show(struct gpio_peripheral_obj *peripheral_obj,	\
+			struct gpio_peripheral_attribute *attr,		\
+			char *buf)					\
+{									\
+	(void) attr;							\
+	return sprintf(buf, "%u\n", peripheral_obj->field);		\
+}									\
+									\
+static ssize_t field##_store(struct gpio_peripheral_obj *peripheral_obj, \
+			struct gpio_peripheral_attribute *attr,		\
+			const char *buf, size_t count)			\
+{									\
+	unsigned int value;						\
+									\
+	(void) attr;							\
+	if (sscanf(buf, "%u", &value) != 1)				\
+		return -EINVAL;						\
+	peripheral_obj->field = value;					\
+	return count;							\
+}
+
+INDIGO_KEEP_ON_ATTR(keep_on_grace_ms)
+INDIGO_KEEP_ON_ATTR(keep_on_backoff_ms)
+INDIGO_KEEP_ON_ATTR(keep_on_backoff_max_ms)
+INDIGO_KEEP_ON_ATTR(keep_on_budget)
+INDIGO_KEEP_ON_ATTR(keep_on_window_s)
+
+static ssize_t pin_lookups_show(struct gpio_peripheral_obj *peripheral_obj,
+				struct gpio_peripheral_attribute *attr,
+				char *buf)
+{
+	struct gpio_peripheral *periph;
+
+	sBUG_ON(peripheral_obj == NULL);
+
+	periph = &peripheral_obj->peripheral;
+	(void) attr;
+
+	return sprintf(buf, "lookups %d misses %d\n",
+		atomic_read(&periph->pin_lookups),
+		atomic_read(&periph->pin_lookup_misses));
+}
+
+/*
+ * "all" cancels queued commands and aborts the running one,
+ * "queued" leaves the running one alone, "<id>" cancels just that
+ * command. -ESRCH if nothing was cancelled.
+ */
+static ssize_t cancel_store(struct gpio_peripheral_obj *peripheral_obj,
+			struct gpio_peripheral_attribute *attr,
+			const char *buf, size_t count)
+{
+	u32 id = 0;
+	bool running = true;
+
+	(void) attr;
+
+	if (strncmp(buf, "queued", 6) == 0)
+		running = false;
+	else if (strncmp(buf, "all", 3) != 0 && sscanf(buf, "%u", &id) != 1)
+		return -EINVAL;
+
+	if (indigo_peripheral_cancel(peripheral_obj, id, running) == 0)
+		return -ESRCH;
+
+	return count;
+}
+
+static ssize_t command_deadline_ms_show(struct gpio_peripheral_obj *peripheral_obj,
+					struct gpio_peripheral_attribute *attr,
+					char *buf)
+{
+	(void) attr;
+
+	return sprintf(buf, "%u\n", peripheral_obj->command_deadline_ms);
+}
+
+/* default deadline for commands queued from now on, 0 -- none */
+static ssize_t command_deadline_ms_store(struct gpio_peripheral_obj *peripheral_obj,
+					struct gpio_peripheral_attribute *attr,
+					const char *buf, size_t count)
+{
+	unsigned int value;
+
+	(void) attr;
+
+	if (sscanf(buf, "%u", &value) != 1)
+		return -EINVAL;
+
+	peripheral_obj->command_deadline_ms = value;
+
+	return count;
+}
+
+static const char *indigo_learned_names[2] = { "down", "up" };
+
+/* "up|down p99_ms samples misses" per line */
+static ssize_t learned_timeouts_show(struct gpio_peripheral_obj *peripheral_obj,
+				struct gpio_peripheral_attribute *attr,
+				char *buf)
+{
+	ssize_t len = 0;
+	unsigned int count;
+	unsigned int misses;
+	int value;
+
+	(void) attr;
+
+	for (value = 1; value >= 0; value--) {
+		spin_lock_irq(&peripheral_obj->timing_lock);
+		count = peripheral_obj->learned[value].count;
+		misses = peripheral_obj->learned[value].misses;
+		spin_unlock_irq(&peripheral_obj->timing_lock);
+
+		len += sprintf(buf + len, "%s %u %u %u\n", indigo_learned_names[value],
+			indigo_learned_p99(peripheral_obj, value), count, misses);
+	}
+
+	return len;
+}
+
+/*
+ * "up|down <ms>" seeds history with a saved p99, e.g. after reboot,
+ * 0 forgets it
+ */
+static ssize_t learned_timeouts_store(struct gpio_peripheral_obj *peripheral_obj,
+				struct gpio_peripheral_attribute *attr,
+				const char *buf, size_t count)
+{
+	struct indigo_learned_timeout *learned;
+	char direction[8];
+	unsigned int ms;
+	int value;
+	int i;
+
+	(void) attr;
+
+	if (sscanf(buf, "%7s %u", direction, &ms) != 2)
+		return -EINVAL;
+
+	if (strcmp(direction, "up") == 0)
+		value = 1;
+	else if (strcmp(direction, "down") == 0)
+		value = 0;
+	else
+		return -EINVAL;
+
+	learned = &peripheral_obj->learned[value];
+
+	spin_lock_irq(&peripheral_obj->timing_lock);
+	for (i = 0; i < INDIGO_LEARN_SAMPLES; i++)
+		learned->samples_ms[i] = ms;
+	learned->next = 0;
+	learned->count = ms != 0 ? INDIGO_LEARN_SAMPLES : 0;
+	learned->misses = 0;
+	spin_unlock_irq(&peripheral_obj->timing_lock);
+
 	return count;
 }
 
+static const char *const indigo_edge_names[] = {
+	[GPIOF_EDGE_BOTH >> 6] = "both",
+	[GPIOF_EDGE_RISING >> 6] = "rising",
+	[GPIOF_EDGE_FALLING >> 6] = "falling",
+	[GPIOF_EDGE_MASK >> 6] = "both",
+};
+
+/* "<pin> <edges> <debounce_ms> <max_rate_hz>" per pollable pin */
+static ssize_t pin_filter_show(struct gpio_peripheral_obj *peripheral_obj,
+			struct gpio_peripheral_attribute *attr,
+			char *buf)
+{
+	struct indigo_periph_pin *pin;
+	ssize_t len = 0;
+	int i;
+
+	(void) attr;
+
+	for (i = 0; i < INDIGO_MAX_GPIOPERIPH_PIN_COUNT; i++) {
+		pin = &peripheral_obj->peripheral.pins[i];
+		if (pin->description == NULL)
+			break;
+		if ((pin->flags & GPIOF_POLLABLE) == 0)
+			continue;
+
+		len += sprintf(buf + len, "%s %s %d %d\n", pin->schematics_name,
+			indigo_edge_names[(pin->flags & GPIOF_EDGE_MASK) >> 6],
+			pin->debounce_ms, pin->max_rate_hz);
+	}
+
+	return len;
+}
+
+/* same format as read, overrides what board file says; 0 turns a limit off */
+static ssize_t pin_filter_store(struct gpio_peripheral_obj *peripheral_obj,
+			struct gpio_peripheral_attribute *attr,
+			const char *buf, size_t count)
+{
+	struct indigo_periph_pin *pin;
+	char name[32];
+	char edges[8];
+	int debounce_ms;
+	int max_rate_hz;
+	unsigned int flags;
+	int i;
+
+	(void) attr;
+
+	if (sscanf(buf, "%31s %7s %d %d", name, edges, &debounce_ms, &max_rate_hz) != 4)
+		return -EINVAL;
+
+	if (debounce_ms < 0 || max_rate_hz < 0)
+		return -EINVAL;
+
+	for (flags = 0; flags < ARRAY_SIZE(indigo_edge_names); flags++)
+		if (indigo_edge_names[flags] != NULL && strcmp(edges, indigo_edge_names[flags]) == 0)
+			break;
+
+	if (flags == ARRAY_SIZE(indigo_edge_names))
+		return -EINVAL;
+
+	for (i = 0; i < INDIGO_MAX_GPIOPERIPH_PIN_COUNT; i++) {
+		pin = &peripheral_obj->peripheral.pins[i];
+		if (pin->description == NULL)
+			break;
+		if ((pin->flags & GPIOF_POLLABLE) == 0)
+			continue;
+		if (strcmp(pin->schematics_name, name) != 0)
+			continue;
+
+		spin_lock_irq(&pin->filter_lock);
+		pin->flags = (pin->flags & ~GPIOF_EDGE_MASK) | (flags << 6);
+		pin->debounce_ms = debounce_ms;
+		pin->max_rate_hz = max_rate_hz;
+		spin_unlock_irq(&pin->filter_lock);
+
+		return count;
+	}
+
+	return -ENOENT;
+}
+
+/* runtime counters, one "name value" pair per line */
+static ssize_t stats_show(struct gpio_peripheral_obj *peripheral_obj,
+			struct gpio_peripheral_attribute *attr,
+			char *buf)
+{
+	struct indigo_periph_stats *stats = &peripheral_obj->stats;
+	struct gpio_peripheral *periph = &peripheral_obj->peripheral;
+	u64 powered_ns;
+	ssize_t len;
+	int i;
+
+	(void) attr;
+
+	spin_lock_irq(&peripheral_obj->command_lock);
+	powered_ns = stats->powered_ns;
+	if (stats->powered)
+		powered_ns += ktime_to_ns(ktime_sub(ktime_get(), stats->powered_since));
+	spin_unlock_irq(&peripheral_obj->command_lock);
+
+	len = sprintf(buf,
+		"submitted %d\ncompleted %d\nfailed %d\ncoalesced %d\n"
+		"keep_on_restarts %d\nstatus_timeouts %d\nwindow_violations %d\n"
+		"powered_on_ms %llu\n",
+		atomic_read(&stats->submitted),
+		atomic_read(&stats->completed),
+		atomic_read(&stats->failed),
+		atomic_read(&stats->coalesced),
+		atomic_read(&stats->keep_on_restarts),
+		atomic_read(&stats->status_timeouts),
+		atomic_read(&stats->window_violations),
+		(unsigned long long) div_u64(powered_ns, NSEC_PER_MSEC));
+
+	for (i = 0; i < INDIGO_MAX_GPIOPERIPH_PIN_COUNT; i++) {
+		if (periph->pins[i].description == NULL)
+			break;
+		if ((periph->pins[i].flags & GPIOF_POLLABLE) == 0)
+			continue;
+
+		len += sprintf(buf + len, "irqs_%s %d\nfiltered_%s %d\n",
+			periph->pins[i].schematics_name,
+			atomic_read(&stats->pin_irqs[i]),
+			periph->pins[i].schematics_name,
+			atomic_read(&stats->pin_filtered[i]));
+	}
+
+	return len;
+}
 
 #if 0
 static ssize_t dummy_store(struct gpio_peripheral_obj *periph_obj, struct gpio_peripheral_attribute *attr,
@@ -1586,7 +3804,6 @@ static ssize_t gpio_store(struct gpio_peripheral_obj *periph_obj,
 	int value;
 	int len;
 
-	(void) periph_obj;
 	(void) attr;
 	(void) buf;
 
@@ -1608,6 +3825,11 @@ static ssize_t gpio_store(struct gpio_peripheral_obj *periph_obj,
 	}
 
 	gpio_set_value(pin->pin_no, value);
+	indigo_state_set_pin(periph_obj, pin - periph_obj->peripheral.pins, value != 0);
+	indigo_status_invalidate(periph_obj);
+	/* refill, the state page shows the cache */
+	if (periph_obj->peripheral.status != NULL)
+		indigo_peripheral_status(periph_obj);
 
 out:
 	TRACE_EXIT();
@@ -1618,7 +3840,9 @@ out:
 static ssize_t power_on_store(struct gpio_peripheral_obj *peripheral_obj, struct gpio_peripheral_attribute *attr,
 			const char *buf, size_t count)
 {
-	struct completion *complete;
+	struct gpio_peripheral_command *gp_cmd;
+	ssize_t result;
+
 	TRACE_ENTRY();
 
 	sBUG_ON(peripheral_obj == NULL);
@@ -1626,19 +3850,21 @@ static ssize_t power_on_store(struct gpio_peripheral_obj *peripheral_obj, struct
 	(void) buf;
 	(void) attr;
 
-	complete = indigo_peripheral_create_command(&peripheral_obj->peripheral, INDIGO_COMMAND_POWER_ON);
-	wait_for_completion_interruptible(complete);
-	indigo_peripheral_free_completed_commands(peripheral_obj);
+	gp_cmd = indigo_peripheral_create_command(&peripheral_obj->peripheral, INDIGO_COMMAND_POWER_ON,
+						INDIGO_ORIGIN_SYSFS);
+	result = indigo_peripheral_command_result(peripheral_obj, gp_cmd, count);
 
 
 	TRACE_EXIT();
-	return count;
+	return result;
 }
 
 static ssize_t check_and_power_on_store(struct gpio_peripheral_obj *peripheral_obj, struct gpio_peripheral_attribute *attr,
 					const char *buf, size_t count)
 {
-	struct completion *complete;
+	struct gpio_peripheral_command *gp_cmd;
+	ssize_t result;
+
 	TRACE_ENTRY();
 
 	sBUG_ON(peripheral_obj == NULL);
@@ -1646,18 +3872,20 @@ static ssize_t check_and_power_on_store(struct gpio_peripheral_obj *peripheral_o
 	(void) buf;
 	(void) attr;
 
-	complete = indigo_peripheral_create_command(&peripheral_obj->peripheral, INDIGO_COMMAND_CHECK_AND_POWER_ON);
-	wait_for_completion_interruptible(complete);
-	indigo_peripheral_free_completed_commands(peripheral_obj);
+	gp_cmd = indigo_peripheral_create_command(&peripheral_obj->peripheral, INDIGO_COMMAND_CHECK_AND_POWER_ON,
+						INDIGO_ORIGIN_SYSFS);
+	result = indigo_peripheral_command_result(peripheral_obj, gp_cmd, count);
 
 	TRACE_EXIT();
-	return count;
+	return result;
 }
 
 static ssize_t power_off_store(struct gpio_peripheral_obj *peripheral_obj, struct gpio_peripheral_attribute *attr,
 			const char *buf, size_t count)
 {
-	struct completion *complete;
+	struct gpio_peripheral_command *gp_cmd;
+	ssize_t result;
+
 	TRACE_ENTRY();
 
 	sBUG_ON(peripheral_obj == NULL);
@@ -1665,19 +3893,21 @@ static ssize_t power_off_store(struct gpio_peripheral_obj *peripheral_obj, struc
 	(void) buf;
 	(void) attr;
 
-	complete = indigo_peripheral_create_command(&peripheral_obj->peripheral, INDIGO_COMMAND_POWER_OFF);
-	wait_for_completion_interruptible(complete);
-	indigo_peripheral_free_completed_commands(peripheral_obj);
+	gp_cmd = indigo_peripheral_create_command(&peripheral_obj->peripheral, INDIGO_COMMAND_POWER_OFF,
+						INDIGO_ORIGIN_SYSFS);
+	result = indigo_peripheral_command_result(peripheral_obj, gp_cmd, count);
 
 	TRACE_EXIT();
-	return count;
+	return result;
 
 }
 
 static ssize_t reset_store(struct gpio_peripheral_obj *peripheral_obj, struct gpio_peripheral_attribute *attr,
 			const char *buf, size_t count)
 {
-	struct completion *complete;
+	struct gpio_peripheral_command *gp_cmd;
+	ssize_t result;
+
 	TRACE_ENTRY();
 
 	sBUG_ON(peripheral_obj == NULL);
@@ -1685,13 +3915,301 @@ static ssize_t reset_store(struct gpio_peripheral_obj *peripheral_obj, struct gp
 	(void) buf;
 	(void) attr;
 
-	complete = indigo_peripheral_create_command(&peripheral_obj->peripheral, INDIGO_COMMAND_RESET);
-	wait_for_completion_interruptible(complete);
-	indigo_peripheral_free_completed_commands(peripheral_obj);
+	gp_cmd = indigo_peripheral_create_command(&peripheral_obj->peripheral, INDIGO_COMMAND_RESET,
+						INDIGO_ORIGIN_SYSFS);
+	result = indigo_peripheral_command_result(peripheral_obj, gp_cmd, count);
 
 	TRACE_EXIT();
-	return count;
+	return result;
+
+}
+
+/* debugfs: /sys/kernel/debug/indigo/<peripheral>/ */
+static struct dentry *indigo_debugfs_root;
+
+static const char *indigo_latency_names[INDIGO_LATENCY_KINDS] = {
+	[INDIGO_LATENCY_QUEUE] = "queue",
+	[INDIGO_LATENCY_EXEC] = "exec",
+	[INDIGO_LATENCY_STATUS_WAIT] = "status_wait",
+};
+
+/*
+ * one line per command and latency kind:
+ * command kind count p50_ms p99_ms buckets...
+ * then one per command for timed steps, in us:
+ * command step_overshoot count early p50_us p99_us buckets...
+ * percentiles are bucket upper bounds
+ */
+static int indigo_latency_show(struct seq_file *m, void *v)
+{
+	struct gpio_peripheral_obj *peripheral_obj = m->private;
+	struct indigo_latency_hist *hist;
+	int cmd;
+	int kind;
+	int i;
+
+	(void) v;
+
+	seq_printf(m, "# command kind count p50_ms p99_ms buckets(<1ms <2ms <4ms ...)\n");
+
+	for (cmd = 0; cmd < INDIGO_COMMAND_COUNT; cmd++) {
+		for (kind = 0; kind < INDIGO_LATENCY_KINDS; kind++) {
+			hist = &peripheral_obj->latency[cmd][kind];
+
+			seq_printf(m, "%s %s %d %u %u",
+				indigo_command_name(cmd), indigo_latency_names[kind],
+				atomic_read(&hist->count),
+				indigo_latency_percentile(hist, 50),
+				indigo_latency_percentile(hist, 99));
+
+			for (i = 0; i < INDIGO_LATENCY_BUCKETS; i++)
+				seq_printf(m, " %d", atomic_read(&hist->buckets[i]));
+
+			seq_putc(m, '\n');
+		}
+	}
+
+	seq_printf(m, "# command step_overshoot count early p50_us p99_us buckets(<1us <2us <4us ...)\n");
+
+	for (cmd = 0; cmd < INDIGO_COMMAND_COUNT; cmd++) {
+		hist = &peripheral_obj->step_overshoot[cmd];
+
+		seq_printf(m, "%s step_overshoot %d %d %u %u",
+			indigo_command_name(cmd), atomic_read(&hist->count),
+			atomic_read(&peripheral_obj->step_early[cmd]),
+			indigo_latency_percentile(hist, 50),
+			indigo_latency_percentile(hist, 99));
+
+		for (i = 0; i < INDIGO_LATENCY_BUCKETS; i++)
+			seq_printf(m, " %d", atomic_read(&hist->buckets[i]));
+
+		seq_putc(m, '\n');
+	}
+
+	return 0;
+}
+
+static int indigo_latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, indigo_latency_show, inode->i_private);
+}
+
+static const struct file_operations indigo_latency_fops = {
+	.owner = THIS_MODULE,
+	.open = indigo_latency_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/*
+ * one line per timed step: step_no requested_ms count last/min/max/avg
+ * error (actual - requested) in us, then the step description
+ */
+static int indigo_step_timing_show(struct seq_file *m, void *v)
+{
+	struct gpio_peripheral_obj *peripheral_obj = m->private;
+	struct indigo_step_timing timing;
+	int i;
+
+	(void) v;
+
+	seq_printf(m, "# msleep overshoot %d us, compensation %s, executor %s\n",
+		peripheral_obj->sleep_overshoot_us,
+		sleep_compensation ? "on" : "off",
+		ACCESS_ONCE(peripheral_obj->rt_thread) != NULL ? "rt thread" : "workqueue");
+	seq_printf(m, "# step requested_ms count last_us min_us max_us avg_us description\n");
+
+	for (i = 0; i < INDIGO_STEP_TIMING_SLOTS; i++) {
+		spin_lock_irq(&peripheral_obj->timing_lock);
+		timing = peripheral_obj->step_timing[i];
+		spin_unlock_irq(&peripheral_obj->timing_lock);
+
+		if (timing.step_desc == NULL)
+			break;
+
+		seq_printf(m, "%s %u %u %d %d %d %lld %s\n",
+			timing.step_no, timing.requested_ms, timing.count,
+			timing.last_err_us, timing.min_err_us, timing.max_err_us,
+			div_s64(timing.sum_err_us, timing.count), timing.step_desc);
+	}
 
+	return 0;
+}
+
+static int indigo_step_timing_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, indigo_step_timing_show, inode->i_private);
+}
+
+static const struct file_operations indigo_step_timing_fops = {
+	.owner = THIS_MODULE,
+	.open = indigo_step_timing_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static const char *indigo_origin_names[INDIGO_ORIGIN_COUNT] = {
+	[INDIGO_ORIGIN_SYSFS] = "sysfs",
+	[INDIGO_ORIGIN_KEEP_ON] = "keep_on",
+	[INDIGO_ORIGIN_BOOT] = "boot",
+	[INDIGO_ORIGIN_IOCTL] = "ioctl",
+};
+
+/*
+ * oldest first: id origin command enqueued_ms (monotonic)
+ * queued_us exec_us result
+ */
+static int indigo_journal_show(struct seq_file *m, void *v)
+{
+	struct gpio_peripheral_obj *peripheral_obj = m->private;
+	struct indigo_journal_entry *journal;
+	struct indigo_journal_entry *entry;
+	unsigned int next;
+	unsigned int count;
+	unsigned int i;
+
+	(void) v;
+
+	/* one consistent snapshot, not to hold the lock while printing */
+	journal = kmalloc(sizeof(peripheral_obj->journal), GFP_KERNEL);
+	if (journal == NULL)
+		return -ENOMEM;
+
+	spin_lock_irq(&peripheral_obj->command_lock);
+	memcpy(journal, peripheral_obj->journal, sizeof(peripheral_obj->journal));
+	next = peripheral_obj->journal_next;
+	spin_unlock_irq(&peripheral_obj->command_lock);
+
+	count = min_t(unsigned int, next, INDIGO_JOURNAL_SIZE);
+
+	seq_printf(m, "# id origin command enqueued_ms queued_us exec_us result\n");
+
+	for (i = next - count; i != next; i++) {
+		entry = &journal[i % INDIGO_JOURNAL_SIZE];
+
+		seq_printf(m, "%u %s %s %lld %lld %lld %d\n",
+			entry->id, indigo_origin_names[entry->origin],
+			indigo_command_name(entry->cmd),
+			ktime_to_ms(entry->enqueued),
+			ktime_us_delta(entry->started, entry->enqueued),
+			ktime_us_delta(entry->finished, entry->started),
+			entry->result);
+	}
+
+	kfree(journal);
+	return 0;
+}
+
+static int indigo_journal_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, indigo_journal_show, inode->i_private);
+}
+
+static const struct file_operations indigo_journal_fops = {
+	.owner = THIS_MODULE,
+	.open = indigo_journal_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/*
+ * VCD of the waveform ring, one wire per pin named by schematics_name,
+ * time in us from the oldest recorded event
+ */
+static int indigo_waveform_show(struct seq_file *m, void *v)
+{
+	struct indigo_waveform_event *events;
+	struct indigo_waveform_event *event;
+	const struct indigo_periph_pin *signals[INDIGO_WAVEFORM_SIGNALS];
+	int signal_count = 0;
+	unsigned int next;
+	unsigned int count;
+	unsigned int i;
+	int j;
+
+	(void) v;
+
+	events = kmalloc(sizeof(indigo_waveform), GFP_KERNEL);
+	if (events == NULL)
+		return -ENOMEM;
+
+	spin_lock_irq(&indigo_waveform_lock);
+	memcpy(events, indigo_waveform, sizeof(indigo_waveform));
+	next = indigo_waveform_next;
+	spin_unlock_irq(&indigo_waveform_lock);
+
+	count = min_t(unsigned int, next, INDIGO_WAVEFORM_SIZE);
+
+	seq_printf(m, "$timescale 1us $end\n$scope module indigo $end\n");
+	for (i = next - count; i != next; i++) {
+		event = &events[i % INDIGO_WAVEFORM_SIZE];
+
+		for (j = 0; j < signal_count; j++)
+			if (signals[j] == event->pin)
+				break;
+
+		if (j < signal_count || signal_count == INDIGO_WAVEFORM_SIGNALS)
+			continue;
+
+		signals[signal_count++] = event->pin;
+		seq_printf(m, "$var wire 1 %c %s $end\n", '!' + j,
+			event->pin->schematics_name != NULL ?
+			event->pin->schematics_name : event->pin->description);
+	}
+	seq_printf(m, "$upscope $end\n$enddefinitions $end\n");
+
+	for (i = next - count; i != next; i++) {
+		event = &events[i % INDIGO_WAVEFORM_SIZE];
+
+		for (j = 0; j < signal_count; j++)
+			if (signals[j] == event->pin)
+				break;
+
+		if (j == signal_count)
+			continue;
+
+		seq_printf(m, "#%lld\n%d%c\n",
+			ktime_us_delta(event->time, events[(next - count) % INDIGO_WAVEFORM_SIZE].time),
+			event->level != 0, '!' + j);
+	}
+
+	kfree(events);
+	return 0;
+}
+
+static int indigo_waveform_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, indigo_waveform_show, inode->i_private);
+}
+
+static const struct file_operations indigo_waveform_fops = {
+	.owner = THIS_MODULE,
+	.open = indigo_waveform_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/* debugfs is optional, errors are ignored */
+static void indigo_debugfs_add_peripheral(struct gpio_peripheral_obj *peripheral_obj)
+{
+	if (IS_ERR_OR_NULL(indigo_debugfs_root))
+		return;
+
+	peripheral_obj->debugfs_dir = debugfs_create_dir(peripheral_obj->peripheral.name,
+							indigo_debugfs_root);
+	if (IS_ERR_OR_NULL(peripheral_obj->debugfs_dir))
+		return;
+
+	debugfs_create_file("latency", S_IRUGO, peripheral_obj->debugfs_dir,
+			peripheral_obj, &indigo_latency_fops);
+	debugfs_create_file("step_timing", S_IRUGO, peripheral_obj->debugfs_dir,
+			peripheral_obj, &indigo_step_timing_fops);
+	debugfs_create_file("journal", S_IRUGO, peripheral_obj->debugfs_dir,
+			peripheral_obj, &indigo_journal_fops);
 }
 
 /* Our custom sysfs_ops that we will associate with our ktype later on */
@@ -1707,7 +4225,21 @@ static struct gpio_peripheral_attribute gpio_peripheral_attributes_default[] =
 	__ATTR(power_off, 0666, dummy_show, power_off_store),
 	__ATTR(reset, 0666, dummy_show, reset_store),
 	__ATTR(status, 0666, status_show, status_store),
-	__ATTR(check_and_power_on, 0666, dummy_show, check_and_power_on_store)
+	__ATTR(check_and_power_on, 0666, dummy_show, check_and_power_on_store),
+	__ATTR(pin_lookups, 0444, pin_lookups_show, NULL),
+	__ATTR(async, 0666, async_show, async_store),
+	__ATTR(pending, 0444, pending_show, NULL),
+	__ATTR(last_result, 0444, last_result_show, NULL),
+	__ATTR(keep_on_grace_ms, 0666, keep_on_grace_ms_show, keep_on_grace_ms_store),
+	__ATTR(keep_on_backoff_ms, 0666, keep_on_backoff_ms_show, keep_on_backoff_ms_store),
+	__ATTR(keep_on_backoff_max_ms, 0666, keep_on_backoff_max_ms_show, keep_on_backoff_max_ms_store),
+	__ATTR(keep_on_budget, 0666, keep_on_budget_show, keep_on_budget_store),
+	__ATTR(keep_on_window_s, 0666, keep_on_window_s_show, keep_on_window_s_store),
+	__ATTR(stats, 0444, stats_show, NULL),
+	__ATTR(learned_timeouts, 0666, learned_timeouts_show, learned_timeouts_store),
+	__ATTR(cancel, 0222, NULL, cancel_store),
+	__ATTR(command_deadline_ms, 0666, command_deadline_ms_show, command_deadline_ms_store),
+	__ATTR(pin_filter, 0666, pin_filter_show, pin_filter_store)
 };
 
 /*
@@ -1720,6 +4252,20 @@ static struct attribute *gpio_peripheral_attributes_default_sysfs[] = {
 	&gpio_peripheral_attributes_default[2].attr,
 	&gpio_peripheral_attributes_default[3].attr,
 	&gpio_peripheral_attributes_default[4].attr,
+	&gpio_peripheral_attributes_default[5].attr,
+	&gpio_peripheral_attributes_default[6].attr,
+	&gpio_peripheral_attributes_default[7].attr,
+	&gpio_peripheral_attributes_default[8].attr,
+	&gpio_peripheral_attributes_default[9].attr,
+	&gpio_peripheral_attributes_default[10].attr,
+	&gpio_peripheral_attributes_default[11].attr,
+	&gpio_peripheral_attributes_default[12].attr,
+	&gpio_peripheral_attributes_default[13].attr,
+	&gpio_peripheral_attributes_default[14].attr,
+	&gpio_peripheral_attributes_default[15].attr,
+	&gpio_peripheral_attributes_default[16].attr,
+	&gpio_peripheral_attributes_default[17].attr,
+	&gpio_peripheral_attributes_default[18].attr,
 	NULL,   /* need to NULL terminate the list of attributes */
 };
 
@@ -1736,10 +4282,13 @@ static struct kobj_type gpio_peripheral_ktype = {
 
 static struct kset *indigo_kset;
 static LIST_HEAD(kobjects);
+/* peripherals are created in parallel, see indigo_gpio_peripheral_enable */
+static DEFINE_MUTEX(kobjects_lock);
 
 struct gpio_peripheral_obj *create_gpio_peripheral_obj(struct gpio_peripheral *peripheral)
 {
 	struct gpio_peripheral_obj *peripheral_obj = NULL;
+	struct indigo_periph_pin *pin;
 	struct sysfs_dirent *value_sd = NULL;
 	int retval;
 	int i;
@@ -1760,11 +4309,11 @@ struct gpio_peripheral_obj *create_gpio_peripheral_obj(struct gpio_peripheral *p
 
 	/* copy our static structure to kmalloc memory */
 	peripheral_obj->peripheral = *peripheral;
+	indigo_gpioperiph_build_pin_index(&peripheral_obj->peripheral);
 
-	spin_lock_init(&peripheral_obj->command_list_lock);
-	INIT_LIST_HEAD(&peripheral_obj->command_list);
-	/* implies that now peripheral->name should be unique */
-	peripheral_obj->wq = alloc_ordered_workqueue(peripheral->name, 0);
+	spin_lock_init(&peripheral_obj->command_lock);
+	spin_lock_init(&peripheral_obj->timing_lock);
+	indigo_command_slots_init(peripheral_obj);
 
 	/*
 	 * Initialize and add the kobject to the kernel.  All the default files
@@ -1777,66 +4326,98 @@ struct gpio_peripheral_obj *create_gpio_peripheral_obj(struct gpio_peripheral *p
 	if (retval)
 		goto out_put;
 
+	/* falls back to indigo_wq if it fails */
+	indigo_rt_thread_start(peripheral_obj);
+
 	/* --------------------------------------- */
 	indigo_configure_general_pins(peripheral);
 	/* --------------------------------------- */
 
-	INIT_WORK(&peripheral_obj->check_status_work, indigo_check_status);
+	INIT_DELAYED_WORK(&peripheral_obj->check_status_work, indigo_check_status);
+	peripheral_obj->keep_on_grace_ms = INDIGO_KEEP_ON_GRACE_MS;
+	peripheral_obj->keep_on_backoff_ms = INDIGO_KEEP_ON_BACKOFF_MS;
+	peripheral_obj->keep_on_backoff_max_ms = INDIGO_KEEP_ON_BACKOFF_MAX_MS;
+	peripheral_obj->keep_on_budget = INDIGO_KEEP_ON_BUDGET;
+	peripheral_obj->keep_on_window_s = INDIGO_KEEP_ON_WINDOW_S;
+	peripheral_obj->keep_on_window_start = jiffies;
+	init_waitqueue_head(&peripheral_obj->status_wait);
+	seqlock_init(&peripheral_obj->status_lock);
+	peripheral_obj->status_cache = INDIGO_STATUS_UNKNOWN;
+	indigo_state_add_peripheral(peripheral_obj);
 
 	for (i = 0; i < INDIGO_MAX_GPIOPERIPH_PIN_COUNT; i++) {
-		if (peripheral->pins[i].description == NULL)
+		if (peripheral_obj->peripheral.pins[i].description == NULL)
 			break;
 
+		/* the object's copy, IRQ handlers find the object through it */
+		pin = &peripheral_obj->peripheral.pins[i];
+		pin->periph = &peripheral_obj->peripheral;
+
 		/* read-only attribute */
-		peripheral->pins[i].sysfs_attr.attr.name = peripheral->pins[i].schematics_name;
-		peripheral->pins[i].sysfs_attr.attr.mode = 0666;
-		peripheral->pins[i].sysfs_attr.show = gpio_show;
-		peripheral->pins[i].sysfs_attr.store = gpio_store;
+		pin->sysfs_attr.attr.name = pin->schematics_name;
+		pin->sysfs_attr.attr.mode = 0666;
+		pin->sysfs_attr.show = gpio_show;
+		pin->sysfs_attr.store = gpio_store;
 		/* add file to sysfs. not too sure about rolling back */
-		retval = sysfs_create_file(&peripheral_obj->kobj, &peripheral->pins[i].sysfs_attr.attr);
+		retval = sysfs_create_file(&peripheral_obj->kobj, &pin->sysfs_attr.attr);
 		if (retval) {
 			printk(KERN_ERR "error creating sysfs file\n");
 			continue;
 		};
 
-		if (peripheral->pins[i].flags & GPIOF_POLLABLE) {
+		if (pin->flags & GPIOF_POLLABLE) {
 			/* first, get struct sysfs_dirent for current attribute */
-			value_sd = sysfs_get_dirent(peripheral_obj->kobj.sd, NULL, peripheral->pins[i].schematics_name);
-			peripheral->pins[i].value_sd = value_sd;
+			value_sd = sysfs_get_dirent(peripheral_obj->kobj.sd, NULL, pin->schematics_name);
+			pin->value_sd = value_sd;
 
 			if (value_sd == NULL)
 				printk(KERN_ERR "couldn't get sysfs dirent for pin %s\n",
-					peripheral->pins[i].schematics_name);
+					pin->schematics_name);
 
-			INIT_WORK(&peripheral->pins[i].work, indigo_pin_notify_sysfs);
+			spin_lock_init(&pin->filter_lock);
+			setup_timer(&pin->settle_timer, indigo_pin_settle_timer_fn,
+				(unsigned long) pin);
+			pin->last_level = gpio_get_value(pin->pin_no);
+			indigo_state_set_pin(peripheral_obj, i, pin->last_level);
 
 			/* second, register the interrupt handler */
-			if (request_irq(gpio_to_irq(peripheral->pins[i].pin_no),
+			if (request_threaded_irq(gpio_to_irq(pin->pin_no),
+						indigo_pin_edge_hardirq,
 						indigo_pin_notify_change_handler,
-						IRQF_TRIGGER_FALLING | IRQF_TRIGGER_RISING,
-						peripheral->pins[i].schematics_name,
-						(void *) &peripheral->pins[i].work)) {
+						IRQF_TRIGGER_FALLING | IRQF_TRIGGER_RISING | IRQF_ONESHOT,
+						pin->schematics_name,
+						(void *) pin)) {
 
 				printk(KERN_ERR "couldn't set up change handler for pin %s\n",
-					peripheral->pins[i].schematics_name);
+					pin->schematics_name);
+			} else {
+				pin->irq_requested = true;
 			}
 		}
 	}
 
 	/* in order to release all of 'em */
 	INIT_LIST_HEAD(&peripheral_obj->kobject_item);
+	mutex_lock(&kobjects_lock);
 	list_add_tail(&peripheral_obj->kobject_item, &kobjects);
+	mutex_unlock(&kobjects_lock);
 
 	/* ------ specific for each device ---------- */
 	peripheral_obj->peripheral.setup(&peripheral_obj->peripheral);
 	/* ------------------------------------------ */
 
+	indigo_state_set_flags(peripheral_obj);
+	if (peripheral_obj->peripheral.status != NULL)
+		indigo_peripheral_status(peripheral_obj);
+
 	/*
 	 * We are always responsible for sending the uevent that the kobject
 	 * was added to the system.
 	 */
 	kobject_uevent(&peripheral_obj->kobj, KOBJ_ADD);
 
+	indigo_debugfs_add_peripheral(peripheral_obj);
+
 out:
 	return peripheral_obj;
 
@@ -1852,6 +4433,262 @@ static void destroy_gpio_peripheral_obj(struct gpio_peripheral_obj *gpio_periphe
 	kobject_put(&gpio_peripheral_obj->kobj);
 }
 
+/*
+ * /dev/indigo: batched command submission
+ *
+ * One INDIGO_IOC_SUBMIT carries up to INDIGO_BATCH_MAX records. All of
+ * them are queued first, so commands for different peripherals run in
+ * parallel, then the ioctl waits for those without INDIGO_RECORD_NOWAIT
+ * and copies ids and results back into the same records.
+ */
+static struct gpio_peripheral_obj *indigo_find_peripheral_obj(const char *name)
+{
+	struct gpio_peripheral_obj *obj;
+	struct gpio_peripheral_obj *found = NULL;
+
+	mutex_lock(&kobjects_lock);
+	list_for_each_entry(obj, &kobjects, kobject_item) {
+		if (strcmp(obj->peripheral.name, name) == 0) {
+			found = obj;
+			break;
+		}
+	}
+	mutex_unlock(&kobjects_lock);
+
+	return found;
+}
+
+static int indigo_submit_record(struct indigo_command_record *record,
+				unsigned int deadline_ms,
+				struct gpio_peripheral_command **gp_cmd)
+{
+	struct gpio_peripheral_obj *obj;
+	enum indigo_command_priority_t priority;
+
+	*gp_cmd = NULL;
+
+	/* NO_COMMAND is not a command */
+	if (record->command < INDIGO_COMMAND_POWER_ON ||
+		record->command > INDIGO_COMMAND_CHECK_AND_POWER_ON)
+		return -EINVAL;
+
+	if ((record->flags & ~INDIGO_RECORD_FLAGS) != 0)
+		return -EINVAL;
+
+	if ((record->flags & INDIGO_RECORD_KEEP_ON) &&
+		(record->flags & INDIGO_RECORD_NO_KEEP_ON))
+		return -EINVAL;
+
+	record->peripheral[INDIGO_PERIPH_NAME_LEN - 1] = '\0';
+	obj = indigo_find_peripheral_obj(record->peripheral);
+	if (obj == NULL)
+		return -ENODEV;
+
+	if (record->flags & INDIGO_RECORD_NO_KEEP_ON)
+		indigo_set_keep_on_handler(&obj->peripheral, NULL);
+
+	priority = indigo_command_priority(record->command, INDIGO_ORIGIN_IOCTL);
+	if (record->flags & INDIGO_RECORD_URGENT)
+		priority = INDIGO_PRIORITY_URGENT;
+
+	*gp_cmd = __indigo_peripheral_create_command(&obj->peripheral, record->command,
+						INDIGO_ORIGIN_IOCTL, priority,
+						deadline_ms != 0 ? deadline_ms : obj->command_deadline_ms);
+	if (IS_ERR(*gp_cmd)) {
+		int result = PTR_ERR(*gp_cmd);
+
+		*gp_cmd = NULL;
+		return result;
+	}
+
+	record->id = (*gp_cmd)->id;
+
+	if (record->flags & INDIGO_RECORD_NOWAIT) {
+		indigo_peripheral_put_command(*gp_cmd);
+		*gp_cmd = NULL;
+	}
+
+	if (record->flags & INDIGO_RECORD_KEEP_ON)
+		indigo_set_keep_on_handler(&obj->peripheral, keep_turned_on_handler_irq);
+
+	return 0;
+}
+
+static long indigo_ioctl_submit(struct indigo_command_batch __user *ubatch)
+{
+	struct indigo_command_batch batch;
+	struct indigo_command_record *records;
+	struct gpio_peripheral_command *gp_cmds[INDIGO_BATCH_MAX];
+	bool interrupted = false;
+	size_t size;
+	long result = 0;
+	u32 i;
+
+	if (copy_from_user(&batch, ubatch, sizeof(batch)))
+		return -EFAULT;
+
+	if (batch.count == 0 || batch.count > INDIGO_BATCH_MAX)
+		return -EINVAL;
+
+	size = batch.count * sizeof(*records);
+	records = kmalloc(size, GFP_KERNEL);
+	if (records == NULL)
+		return -ENOMEM;
+
+	if (copy_from_user(records, (void __user *) (unsigned long) batch.records, size)) {
+		result = -EFAULT;
+		goto out;
+	}
+
+	for (i = 0; i < batch.count; i++) {
+		records[i].id = 0;
+		records[i].result = indigo_submit_record(&records[i], batch.deadline_ms,
+							&gp_cmds[i]);
+	}
+
+	for (i = 0; i < batch.count; i++) {
+		if (gp_cmds[i] == NULL)
+			continue;
+
+		if (!interrupted && wait_for_completion_interruptible(&gp_cmds[i]->complete))
+			interrupted = true;
+
+		if (interrupted && !completion_done(&gp_cmds[i]->complete))
+			records[i].result = -EINTR;
+		else
+			records[i].result = indigo_command_errno(gp_cmds[i]->result);
+
+		indigo_peripheral_put_command(gp_cmds[i]);
+	}
+
+	if (copy_to_user((void __user *) (unsigned long) batch.records, records, size))
+		result = -EFAULT;
+
+out:
+	kfree(records);
+	return result;
+}
+
+static long indigo_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	(void) file;
+
+	switch (cmd) {
+	case INDIGO_IOC_SUBMIT:
+		return indigo_ioctl_submit((struct indigo_command_batch __user *) arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
+/* the state page, read-only */
+static int indigo_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	(void) file;
+
+	if (indigo_state == NULL)
+		return -ENODEV;
+
+	if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start > PAGE_SIZE)
+		return -EINVAL;
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	return dma_mmap_coherent(NULL, vma, indigo_state, indigo_state_dma, PAGE_SIZE);
+}
+
+static const struct file_operations indigo_fops = {
+	.owner = THIS_MODULE,
+	.unlocked_ioctl = indigo_ioctl,
+	.compat_ioctl = indigo_ioctl,
+	.mmap = indigo_mmap,
+};
+
+static struct miscdevice indigo_miscdev = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "indigo",
+	.fops = &indigo_fops,
+};
+static bool indigo_miscdev_registered;
+
+static unsigned long indigo_events_busy;
+
+static int indigo_events_open(struct inode *inode, struct file *file)
+{
+	if (test_and_set_bit(0, &indigo_events_busy))
+		return -EBUSY;
+
+	return nonseekable_open(inode, file);
+}
+
+static int indigo_events_release(struct inode *inode, struct file *file)
+{
+	(void) inode;
+	(void) file;
+
+	clear_bit(0, &indigo_events_busy);
+	return 0;
+}
+
+/* the only reader, no lock needed on the kfifo out side */
+static ssize_t indigo_events_read(struct file *file, char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	unsigned int copied = 0;
+	int result;
+
+	(void) ppos;
+
+	if (count < sizeof(struct indigo_pin_event))
+		return -EINVAL;
+
+	count -= count % sizeof(struct indigo_pin_event);
+
+	while (kfifo_is_empty(&indigo_events)) {
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+
+		if (wait_event_interruptible(indigo_events_wait,
+						!kfifo_is_empty(&indigo_events)))
+			return -ERESTARTSYS;
+	}
+
+	result = kfifo_to_user(&indigo_events, buf, count, &copied);
+	if (result)
+		return (ssize_t) result;
+
+	return (ssize_t) copied;
+}
+
+static unsigned int indigo_events_poll(struct file *file, poll_table *wait)
+{
+	poll_wait(file, &indigo_events_wait, wait);
+
+	if (!kfifo_is_empty(&indigo_events))
+		return POLLIN | POLLRDNORM;
+
+	return 0;
+}
+
+static const struct file_operations indigo_events_fops = {
+	.owner = THIS_MODULE,
+	.open = indigo_events_open,
+	.release = indigo_events_release,
+	.read = indigo_events_read,
+	.poll = indigo_events_poll,
+	.llseek = no_llseek,
+};
+
+static struct miscdevice indigo_events_miscdev = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "indigo_events",
+	.fops = &indigo_events_fops,
+};
+static bool indigo_events_miscdev_registered;
+
 /* единственный ужас -- 3 устройства */
 static struct gpio_peripheral indigo_gpioperiph_platform_data[3];
 
@@ -1888,19 +4725,22 @@ int indigo_gpio_peripheral_init(struct gpio_peripheral peripherals[3])
 		goto out;
 	}
 
-	memcpy(&indigo_gpioperiph_platform_data, peripherals, sizeof(peripherals[0]) * 3);
-
-	indigo_cmd_mem_cache = kmem_cache_create("indigo_periph_cmd",
-						sizeof(struct gpio_peripheral_command),
-						0,
-						SLAB_POISON | SLAB_RED_ZONE,
-						NULL);
-	if (indigo_cmd_mem_cache == NULL) {
-		printk(KERN_ERR "could'nt init mem cache\n");
+	indigo_wq = alloc_workqueue("indigo", WQ_NON_REENTRANT, 0);
+	if (indigo_wq == NULL) {
+		kset_unregister(indigo_kset);
 		result = -ENOMEM;
 		goto out;
 	}
 
+	/* mmap() of /dev/indigo fails without it, nothing else */
+	indigo_state = dma_alloc_coherent(NULL, PAGE_SIZE, &indigo_state_dma, GFP_KERNEL);
+	if (indigo_state != NULL) {
+		memset(indigo_state, 0, PAGE_SIZE);
+		indigo_state->version = INDIGO_STATE_VERSION;
+	}
+
+	memcpy(&indigo_gpioperiph_platform_data, peripherals, sizeof(peripherals[0]) * 3);
+
 	memcpy(&enabled_peripherals[0], &peripherals[0], sizeof(peripherals[0]) * 3);
 	//	platform_device_register(&indigo_gpioperiph_device);
 
@@ -1909,11 +4749,45 @@ out:
 	return result;
 }
 
+/*
+ * Create one peripheral in async context, so the peripherals come up in
+ * parallel. Whatever its setup queues (usually the first power on) runs
+ * on the queue, the boot isn't held up by it: the last boot command
+ * reports the ready time when it finishes.
+ */
+static void indigo_gpio_peripheral_enable_async(void *data, async_cookie_t cookie)
+{
+	struct gpio_peripheral *peripheral = data;
+	struct gpio_peripheral_obj *periph_obj;
+
+	(void) cookie;
+
+	printk(KERN_ERR "adding device %s\n", peripheral->description);
+
+	periph_obj = create_gpio_peripheral_obj(peripheral);
+	if (!periph_obj) {
+		printk(KERN_ERR "fatal error during %s object creation\n",
+			peripheral->description);
+		return;
+	}
+
+	printk(KERN_ERR "indigo gpioperiph: %s peripheral %s added\n",
+		periph_obj->peripheral.name, periph_obj->peripheral.description);
+
+}
+
 static int indigo_gpio_peripheral_enable(void)
 {
 	int result = 0;
 	int i;
-	struct gpio_peripheral_obj *periph_obj;
+
+	indigo_enable_time = ktime_get();
+
+	/* same name as the kset */
+	indigo_debugfs_root = debugfs_create_dir("indigo", NULL);
+	if (!IS_ERR_OR_NULL(indigo_debugfs_root))
+		debugfs_create_file("waveform.vcd", S_IRUGO, indigo_debugfs_root,
+				NULL, &indigo_waveform_fops);
 
 	for (i = 0; i < 3; i++) {
 		if (!enabled_peripherals[i].active) {
@@ -1921,20 +4795,20 @@ static int indigo_gpio_peripheral_enable(void)
 			continue;
 		}
 
-		printk(KERN_ERR "adding device %s\n", enabled_peripherals[i].description);
+		async_schedule(indigo_gpio_peripheral_enable_async, &enabled_peripherals[i]);
+	}
 
-		periph_obj = create_gpio_peripheral_obj(&enabled_peripherals[i]);
-		if (!periph_obj) {
-			printk(KERN_ERR "fatal error during object creation\n");
-			result = -EINVAL;
-			goto out;
-		}
+	/* sysfs keeps working without them */
+	if (misc_register(&indigo_miscdev))
+		printk(KERN_ERR "couldn't register /dev/%s\n", indigo_miscdev.name);
+	else
+		indigo_miscdev_registered = true;
 
-		printk(KERN_ERR "indigo gpioperiph: %s peripheral %s added\n",
-			periph_obj->peripheral.name, periph_obj->peripheral.description);
-	}
+	if (misc_register(&indigo_events_miscdev))
+		printk(KERN_ERR "couldn't register /dev/%s\n", indigo_events_miscdev.name);
+	else
+		indigo_events_miscdev_registered = true;
 
-out:
 	return result;
 }
 
@@ -1944,14 +4818,30 @@ void indigo_gpio_peripheral_exit(void)
 {
 	struct gpio_peripheral_obj *obj, *tmp;
 
-	kmem_cache_destroy(indigo_cmd_mem_cache);
+	/* peripherals may still be coming up */
+	async_synchronize_full();
+
+	if (indigo_miscdev_registered)
+		misc_deregister(&indigo_miscdev);
+	if (indigo_events_miscdev_registered)
+		misc_deregister(&indigo_events_miscdev);
+
+	/* files there point into peripheral objects */
+	debugfs_remove_recursive(indigo_debugfs_root);
 
 	/* we need to correctly destroy all objects here, not sure about attributes */
 	list_for_each_entry_safe(obj, tmp, &kobjects, kobject_item) {
-		destroy_gpio_peripheral_obj(obj);
+		/* the last put frees obj */
 		list_del(&obj->kobject_item);
+		destroy_gpio_peripheral_obj(obj);
 	}
 	kset_unregister(indigo_kset);
+
+	/* mappings hold /dev/indigo open, so there are none by now */
+	if (indigo_state != NULL)
+		dma_free_coherent(NULL, PAGE_SIZE, indigo_state, indigo_state_dma);
+
+	destroy_workqueue(indigo_wq);
 }
 
 EXPORT_SYMBOL(indigo_gpio_peripheral_init);
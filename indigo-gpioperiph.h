@@ -1,12 +1,20 @@
 #ifndef _INDIGO_GPIOPERIPH_H
 #define _INDIGO_GPIOPERIPH_H
 
+#include <linux/interrupt.h>
+#include <linux/ktime.h>
+#include <linux/ioctl.h>
 #include <linux/kobject.h>
 #include <linux/sysfs.h>
 #include <linux/list.h>
 #include <linux/sched.h>
+#include <linux/seqlock.h>
 #include <linux/workqueue.h>
 #include <linux/spinlock.h>
+#include <linux/timer.h>
+#include <linux/types.h>
+#include <linux/wait.h>
+#include <asm/atomic.h>
 
 #include <mach/gpio.h>
 
@@ -31,6 +39,12 @@
 #define GPIOF_POLLABLE (1 << 5)
 #define GPIOF_NOT_POLLABLE (0 << 5)
 
+/* edges a pollable pin reports, on the wire (before ACTIVE_LOW). None -- both */
+#define GPIOF_EDGE_RISING (1 << 6)
+#define GPIOF_EDGE_FALLING (1 << 7)
+#define GPIOF_EDGE_BOTH (0 << 6)
+#define GPIOF_EDGE_MASK (GPIOF_EDGE_RISING | GPIOF_EDGE_FALLING)
+
 #define GPIOF_DIR_OUT_INIT_LOW (GPIOF_INIT_LOW | GPIOF_DIR_OUT)
 #define GPIOF_DIR_OUT_INIT_HIGH (GPIOF_INIT_HIGH | GPIOF_DIR_OUT)
 
@@ -56,8 +70,9 @@ enum indigo_pin_function_t {
 	INDIGO_FUNCTION_POWER, /* пин управляет ключом, способным обесточить девайс*/
 	INDIGO_FUNCTION_PWRKEY, /* пин управляет входом включения устройства на самом устройстве*/
 	INDIGO_FUNCTION_RESET, /* судя по всему, не нужен, его эмулирует PWRKEY */
-	INDIGO_FUNCTION_STATUS /* для GSM на этой ножке
+	INDIGO_FUNCTION_STATUS, /* для GSM на этой ножке
 				* надо обрабатывать прерывания */
+	INDIGO_FUNCTION_COUNT /* size of function -> pin index, not a function */
 };
 
 enum indigo_gpioperiph_kind_t {
@@ -74,6 +89,7 @@ enum indigo_gpioperiph_command_t {
 	INDIGO_COMMAND_RESET,
 	INDIGO_COMMAND_CHECK_AND_POWER_ON, /* проверить статус и если 0 -- включить */
 	INDIGO_COMMAND_STATE_TRANSITION,
+	INDIGO_COMMAND_COUNT /* not a command */
 };
 
 enum indigo_gpioperiph_sim900_state_t {
@@ -116,8 +132,28 @@ struct indigo_periph_pin {
 
 	struct gpio_peripheral_attribute sysfs_attr;
 
-	struct work_struct work;
 	struct sysfs_dirent *value_sd;
+	bool irq_requested; /* change handler is set up, release frees it */
+	/* last edge, as seen by the hard IRQ half */
+	ktime_t edge_time;
+	int edge_level;
+
+	struct gpio_peripheral *periph; /* owner, set by create_gpio_peripheral_obj() */
+
+	/*
+	 * pollable pins only, 0 -- off. Edges closer than debounce_ms to the
+	 * last reported one are not reported, neither are edges that would
+	 * exceed max_rate_hz; the level the line settles at is reported
+	 * when the window is over. Overridable through pin_filter attribute.
+	 */
+	int debounce_ms;
+	int max_rate_hz;
+
+	/* filter state, under filter_lock */
+	spinlock_t filter_lock;
+	struct timer_list settle_timer;
+	ktime_t last_change; /* last level change the filter took */
+	int last_level;
 };
 
 /*
@@ -142,37 +178,253 @@ struct gpio_peripheral {
 	bool active; /* по умолчанию -- 0 */
 
 	u32 flags;
-};
 
-struct gpio_peripheral_obj {
-	struct kobject kobj; /* dynamic allocation required */
-	struct gpio_peripheral peripheral;
+	/* function -> pin index, built once by create_gpio_peripheral_obj() */
+	u8 function_pins[INDIGO_FUNCTION_COUNT];
+	bool pin_index_ready;
 
-	struct list_head kobject_item;
-	struct list_head command_list; // INIT_LIST_HEAD()
-	/* всё, что надо инициализировать в куче -- в _obj, создавать в конструкторе */
-	/* очередь команд, выделять через alloc_workqueue,
-	 * max_active = 1 */
-	struct workqueue_struct *wq;
-	struct work_struct check_status_work;
-	spinlock_t command_list_lock; // spin_lock_init
+	/* lookups served, and how many of them had to scan pins[] */
+	atomic_t pin_lookups;
+	atomic_t pin_lookup_misses;
+};
 
+/* who asked for a command, see journal file in debugfs */
+enum indigo_command_origin_t {
+	INDIGO_ORIGIN_SYSFS,
+	INDIGO_ORIGIN_KEEP_ON, /* keep-on IRQ */
+	INDIGO_ORIGIN_BOOT, /* setup and module init */
+	INDIGO_ORIGIN_IOCTL, /* /dev/indigo */
+	INDIGO_ORIGIN_COUNT
+};
+
+/*
+ * Queued commands run highest priority first, FIFO within a priority.
+ * An urgent command aborts a running lower priority one.
+ */
+enum indigo_command_priority_t {
+	INDIGO_PRIORITY_LOW, /* keep-on and boot */
+	INDIGO_PRIORITY_NORMAL,
+	INDIGO_PRIORITY_URGENT, /* power_off from userspace */
+	INDIGO_PRIORITY_COUNT
 };
-#define to_gpio_peripheral_obj(x) container_of(x, struct gpio_peripheral_obj, kobj)
 
 struct gpio_peripheral_command {
 	enum indigo_gpioperiph_command_t cmd;
+	u32 id; /* per peripheral, see last_result attribute */
+	int result; /* what the callback returned, valid once completed */
+	/* the queue and every waiter, slot is free again when it drops to 0 */
+	atomic_t refs;
+	bool started; /* under command_lock */
+	enum indigo_command_origin_t origin; /* of the first submitter */
+	ktime_t enqueue_time;
+	ktime_t start_time;
+
+	enum indigo_command_priority_t priority;
+	ktime_t deadline; /* fails with -ETIMEDOUT after it, 0 -- none */
 
 	struct gpio_peripheral *peripheral;
 
-	struct work_struct work;
-
-	struct list_head command_sequence;
+	/* in queues[priority] until started, under command_lock */
+	struct list_head queue_item;
 
 	/* whom to notify when finished */
 	struct completion complete;
 };
 
+#define INDIGO_JOURNAL_SIZE 64
+
+struct indigo_journal_entry {
+	u32 id;
+	enum indigo_gpioperiph_command_t cmd;
+	enum indigo_command_origin_t origin;
+	ktime_t enqueued;
+	ktime_t started;
+	ktime_t finished;
+	int result;
+};
+
+/* log2 latency histogram, bucket N is [2^(N-1), 2^N) ms (us for step overshoot) */
+#define INDIGO_LATENCY_BUCKETS 20
+
+struct indigo_latency_hist {
+	atomic_t count;
+	atomic_t buckets[INDIGO_LATENCY_BUCKETS];
+};
+
+enum indigo_latency_kind_t {
+	INDIGO_LATENCY_QUEUE, /* enqueued -> started */
+	INDIGO_LATENCY_EXEC, /* started -> finished */
+	INDIGO_LATENCY_STATUS_WAIT, /* each STATUS step of a sequence */
+	INDIGO_LATENCY_KINDS
+};
+
+/* per-step timing, see step_timing file in debugfs */
+#define INDIGO_STEP_TIMING_SLOTS 32
+
+struct indigo_step_timing {
+	const char *step_desc; /* string literal, identifies the step */
+	const char *step_no;
+	u32 requested_ms;
+	u32 count;
+	/* actual - requested */
+	s32 last_err_us;
+	s32 min_err_us;
+	s32 max_err_us;
+	s64 sum_err_us;
+};
+
+/*
+ * Learned time-to-status for one direction (status going 0 or 1),
+ * see learned_timeouts attribute
+ */
+#define INDIGO_LEARN_SAMPLES 32
+/* fewer samples than that and the datasheet timeout is used as is */
+#define INDIGO_LEARN_MIN_SAMPLES 8
+#define INDIGO_LEARN_MARGIN_MS 500
+
+struct indigo_learned_timeout {
+	u32 samples_ms[INDIGO_LEARN_SAMPLES];
+	unsigned int next;
+	unsigned int count;
+	unsigned int misses; /* tight timeout ran out, escalated */
+};
+
+/* see stats attribute */
+struct indigo_periph_stats {
+	atomic_t submitted; /* coalesced ones included */
+	atomic_t completed;
+	atomic_t failed; /* completed with non-zero result */
+	atomic_t coalesced;
+	atomic_t keep_on_restarts;
+	atomic_t status_timeouts;
+	atomic_t window_violations; /* steps that overran max_ms */
+	atomic_t pin_irqs[INDIGO_MAX_GPIOPERIPH_PIN_COUNT];
+	atomic_t pin_filtered[INDIGO_MAX_GPIOPERIPH_PIN_COUNT]; /* edges not reported */
+
+	/* under command_lock */
+	bool powered;
+	ktime_t powered_since;
+	u64 powered_ns;
+};
+
+#define INDIGO_STATUS_UNKNOWN (-1)
+
+/* keep-on policy defaults */
+#define INDIGO_KEEP_ON_GRACE_MS 3000
+#define INDIGO_KEEP_ON_BACKOFF_MS 10000
+#define INDIGO_KEEP_ON_BACKOFF_MAX_MS 600000
+#define INDIGO_KEEP_ON_BUDGET 5
+#define INDIGO_KEEP_ON_WINDOW_S 3600
+
+/* preallocated commands per peripheral */
+#define INDIGO_COMMAND_RING_SIZE 16
+
+struct gpio_peripheral_obj {
+	struct kobject kobj; /* dynamic allocation required */
+	struct gpio_peripheral peripheral;
+
+	struct list_head kobject_item;
+	/* всё, что надо инициализировать в куче -- в _obj, создавать в конструкторе */
+	/* all works go to the shared indigo_wq, see indigo-gpioperiph.c */
+	struct delayed_work check_status_work;
+	spinlock_t command_lock; // spin_lock_init
+
+	/*
+	 * scheduler: run_work takes commands from queues[] one by one,
+	 * see indigo_peripheral_run_queue()
+	 */
+	struct work_struct run_work;
+	/* run_work's stand-in with rt_priority set, see indigo_rt_thread_fn() */
+	struct task_struct *rt_thread; /* under command_lock */
+	wait_queue_head_t rt_wait;
+	bool rt_pending; /* under command_lock */
+	/* no more commands are accepted, the object is going away */
+	bool closed; /* under command_lock */
+	struct list_head queues[INDIGO_PRIORITY_COUNT];
+	/* cancelled by an urgent power off, run_work finishes them */
+	struct list_head superseded; /* under command_lock */
+	struct gpio_peripheral_command *running; /* under command_lock */
+	/* -ECANCELED or -ETIMEDOUT, sequences stop at the next step */
+	int abort_reason;
+	unsigned int command_deadline_ms; /* default deadline, 0 -- none */
+	/* last command setup has queued, reports the ready time when done */
+	struct gpio_peripheral_command *boot_cmd; /* under command_lock */
+
+	/*
+	 * command slots and a ring of free slot indices,
+	 * see indigo_peripheral_create_command()
+	 */
+	struct gpio_peripheral_command commands[INDIGO_COMMAND_RING_SIZE];
+	u8 free_slots[INDIGO_COMMAND_RING_SIZE];
+	unsigned int free_head;
+	unsigned int free_count;
+
+	/* woken up by status pin edges, see indigo_status_irq_handler */
+	wait_queue_head_t status_wait;
+	bool status_irq;
+	irq_handler_t keep_on_handler; /* NULL unless GPIO_PERIPH_FLAG_KEEP_ON */
+
+	/*
+	 * logical status as periph->status() returns it, see
+	 * indigo_peripheral_status(). status_gen changes on every write
+	 * but a cache fill, so a fill can't overwrite a newer value.
+	 */
+	seqlock_t status_lock;
+	int status_cache; /* INDIGO_STATUS_UNKNOWN -- read GPIO */
+	unsigned int status_gen;
+
+	/* our part of the /dev/indigo state page, NULL if there's none */
+	struct indigo_state_periph *state;
+
+	/* keep-on restart policy, sysfs attributes of the same name */
+	unsigned int keep_on_grace_ms;
+	unsigned int keep_on_backoff_ms;
+	unsigned int keep_on_backoff_max_ms;
+	unsigned int keep_on_budget; /* restarts per window */
+	unsigned int keep_on_window_s;
+	/* policy state, only touched by check_status_work */
+	unsigned int keep_on_backoff_cur_ms;
+	unsigned int keep_on_restarts;
+	unsigned long keep_on_last_restart;
+	unsigned long keep_on_window_start;
+
+	/* sysfs writers don't wait for their commands if set */
+	bool async;
+	atomic_t command_seq; /* id of last submitted command */
+	atomic_t pending; /* submitted, but not finished yet */
+
+	/* queued or running command of each kind, others join it */
+	struct gpio_peripheral_command *unfinished[INDIGO_COMMAND_COUNT];
+
+	/* last finished command, under command_lock */
+	u32 last_id;
+	enum indigo_gpioperiph_command_t last_cmd;
+	int last_result;
+
+	/* finished commands, journal_next is the total count, under command_lock */
+	struct indigo_journal_entry journal[INDIGO_JOURNAL_SIZE];
+	unsigned int journal_next;
+
+	/* what the queue is executing, status waits are accounted to it */
+	enum indigo_gpioperiph_command_t running_cmd;
+	struct indigo_latency_hist latency[INDIGO_COMMAND_COUNT][INDIGO_LATENCY_KINDS];
+	/* timed steps, actual - requested in us; early -- steps that ended short */
+	struct indigo_latency_hist step_overshoot[INDIGO_COMMAND_COUNT];
+	atomic_t step_early[INDIGO_COMMAND_COUNT];
+
+	struct dentry *debugfs_dir;
+
+	/* msleep engine shortens sleeps by this EWMA of msleep() overshoot */
+	int sleep_overshoot_us;
+	spinlock_t timing_lock;
+	struct indigo_step_timing step_timing[INDIGO_STEP_TIMING_SLOTS];
+	/* indexed by expected status value, under timing_lock */
+	struct indigo_learned_timeout learned[2];
+
+	struct indigo_periph_stats stats;
+};
+#define to_gpio_peripheral_obj(x) container_of(x, struct gpio_peripheral_obj, kobj)
+
 struct indigo_gpio_sequence_step {
 	const char *step_no;
 	const char *step_desc;
@@ -182,8 +434,38 @@ struct indigo_gpio_sequence_step {
 	int mandatory;
 	int sleep_ms;
 	int timeout_ms;
+	/*
+	 * timing window, 0 -- not set. An output step still lasts sleep_ms,
+	 * min_ms is only a floor for it; a status step is not over before
+	 * min_ms even if status is already there. Running shorter than
+	 * min_ms or longer than max_ms is counted as a violation, see stats
+	 * attribute.
+	 */
+	int min_ms;
+	int max_ms;
 };
 
+/* tables: INDIGO_STEP() without a timing window, INDIGO_STEP_WINDOW() with one */
+#define INDIGO_STEP_WINDOW(_no, _desc, _periph, _function, _value, _mandatory, \
+			_sleep_ms, _timeout_ms, _min_ms, _max_ms)		\
+	{								\
+		.step_no = (_no),					\
+		.step_desc = (_desc),					\
+		.periph = (_periph),					\
+		.function = (_function),				\
+		.value = (_value),					\
+		.mandatory = (_mandatory),				\
+		.sleep_ms = (_sleep_ms),				\
+		.timeout_ms = (_timeout_ms),				\
+		.min_ms = (_min_ms),					\
+		.max_ms = (_max_ms),					\
+	}
+
+#define INDIGO_STEP(_no, _desc, _periph, _function, _value, _mandatory,	\
+			_sleep_ms, _timeout_ms)				\
+	INDIGO_STEP_WINDOW(_no, _desc, _periph, _function, _value, _mandatory, \
+			_sleep_ms, _timeout_ms, 0, 0)
+
 /*
  * Функции power_on и т.п. должны быть синхронные,
  * может быть нужен какой-то минимальный общий фреймворк для этого.
@@ -211,6 +493,99 @@ struct indigo_gpio_sequence_step {
 }
 */
 
+/*
+ * /dev/indigo interface
+ *
+ * INDIGO_IOC_SUBMIT takes struct indigo_command_batch, pointing to
+ * @count records. Every record is queued to its peripheral, then the
+ * ioctl waits for all records without INDIGO_RECORD_NOWAIT.
+ * @id and @result of each record are filled on return: @result is 0 if
+ * the command succeeded, -errno otherwise. NOWAIT records only get @id,
+ * their result shows up in the last_result sysfs attribute.
+ */
+#define INDIGO_PERIPH_NAME_LEN 16
+#define INDIGO_BATCH_MAX 32
+
+#define INDIGO_RECORD_NOWAIT 0x1
+#define INDIGO_RECORD_KEEP_ON 0x2 /* like "on-keep" written to status */
+#define INDIGO_RECORD_NO_KEEP_ON 0x4 /* like "on" or "off" written to status */
+#define INDIGO_RECORD_URGENT 0x8 /* run before anything queued, abort what's running */
+#define INDIGO_RECORD_FLAGS (INDIGO_RECORD_NOWAIT | INDIGO_RECORD_KEEP_ON | \
+			INDIGO_RECORD_NO_KEEP_ON | INDIGO_RECORD_URGENT)
+
+struct indigo_command_record {
+	char peripheral[INDIGO_PERIPH_NAME_LEN]; /* "gsm", "gps", ... */
+	__u32 command; /* enum indigo_gpioperiph_command_t */
+	__u32 flags; /* INDIGO_RECORD_* */
+	__u32 id; /* out */
+	__s32 result; /* out */
+};
+
+struct indigo_command_batch {
+	__u32 count;
+	__u32 deadline_ms; /* for every record, 0 -- none */
+	__u64 records; /* struct indigo_command_record * */
+};
+
+#define INDIGO_IOC_MAGIC 'I'
+#define INDIGO_IOC_SUBMIT _IOWR(INDIGO_IOC_MAGIC, 1, struct indigo_command_batch)
+
+/*
+ * /dev/indigo_events: edges of pollable and status pins of every
+ * peripheral, captured in the hard IRQ half. read() returns whole
+ * records, blocks while there are none unless O_NONBLOCK; poll() says
+ * POLLIN when there are. One reader at a time.
+ */
+struct indigo_pin_event {
+	char peripheral[INDIGO_PERIPH_NAME_LEN];
+	__u8 pin; /* index in the peripheral's pins[] */
+	__u8 value; /* level on the wire, as the pin's sysfs file shows */
+	__u16 reserved;
+	__u32 dropped; /* events lost to a full buffer right before this one */
+	__s64 time_ns; /* CLOCK_MONOTONIC */
+};
+
+/*
+ * mmap() of /dev/indigo: one read-only page holding struct
+ * indigo_state_page, kept up to date by the driver, so pollers read
+ * values with plain loads. @seq is odd while the page is being written;
+ * a copy is consistent if @seq was the same even number before and
+ * after it:
+ *
+ *	do {
+ *		seq = page->seq;
+ *		rmb();
+ *		copy = page->periphs[i];
+ *		rmb();
+ *	} while ((seq & 1) != 0 || seq != page->seq);
+ */
+#define INDIGO_STATE_VERSION 1
+#define INDIGO_STATE_MAX_PERIPHS 8
+
+#define INDIGO_STATE_KEEP_ON 0x1 /* status attribute reads "on-keep" */
+
+struct indigo_state_periph {
+	char name[INDIGO_PERIPH_NAME_LEN];
+	__s32 status; /* 1 -- on, 0 -- off, -1 -- unknown, see status attribute */
+	__u32 flags; /* INDIGO_STATE_* */
+	__u32 pins; /* bit N -- level of pins[N] as its sysfs file shows */
+	__u32 pins_valid; /* known bits of @pins: written outputs, pollable and status pins */
+	__u32 pending; /* commands queued or running */
+	__u32 running_id; /* 0 -- nothing is running */
+	__u32 running_cmd; /* enum indigo_gpioperiph_command_t */
+	__u32 last_id; /* last finished command, like last_result attribute */
+	__u32 last_cmd;
+	__s32 last_result;
+};
+
+struct indigo_state_page {
+	__u32 seq;
+	__u32 version; /* INDIGO_STATE_VERSION */
+	__u32 count; /* periphs[] in use */
+	__u32 reserved;
+	struct indigo_state_periph periphs[INDIGO_STATE_MAX_PERIPHS];
+};
+
 /* собственно, мега-апи для инициализации */
 extern struct gpio_peripheral_obj *create_gpio_peripheral_obj(struct gpio_peripheral *peripheral);
 extern int indigo_gpio_peripheral_init(struct gpio_peripheral peripherals[3]);